@@ -33,28 +33,233 @@ if (typeof window.location.protocol === "undefined") {
     window.location.protocol = "http:";
 }
 
+/* global require */
+var crypto = require('crypto');
+
 var MAX_DEVICE_NAME_LENGTH = 95; // 1 less than max on Pebble side to allow for strncpy to insert terminating null in strncpy
 var MAX_ACTION_NAME_LENGTH = 95; // 1 less than max on Pebble side to allow for strncpy to insert terminating null in strncpy
 var DEFAULT_TIMEOUT_BACKOFF = 100;
 
-var deviceCount = localStorage.getItem("deviceCount");
-if (!deviceCount) {
-    deviceCount = 0;
+// Device and action records are packed into a byte array: each is the zigzag varint difference between
+// its number and the one following the previous record's, a byte holding the name's length shifted left
+// by one above the on bit (and below the stale bit, set on a device whose state is only the last one known),
+// then the name's UTF-8 bytes, cut to what the watch menu can show
+var MAX_RECORD_NAME_LENGTH = 40;
+var RECORD_ON_BIT = 0x01;
+var RECORD_STALE_BIT = 0x80;
+var DEFAULT_WATCH_INBOX_SIZE = 124; // Smallest inbox a watch is guaranteed to open, used until the watch tells us its size
+var DICTIONARY_HEADER_SIZE = 1;
+var TUPLE_HEADER_SIZE = 7; // 4 byte key, 1 byte type, 2 byte length
+var INTEGER_SIZE = 4; // Numbers are sent to the watch as 32 bit integers
+var DEFAULT_FETCH_CONCURRENCY = 4; // Most device detail requests we keep in flight to the Indigo Server at once
+var GROUP_CONCURRENCY = 10; // Requests a group command keeps in flight at once, so a room's worth of devices switch together
+// Longest we wait for the Indigo Server to answer a request, digest auth round trip included: REQUEST_TIMEOUT_FACTOR
+// times the slowest of the last REQUEST_TIME_SAMPLES requests of the same kind (e.g. the devices list, or a device's
+// details), within REQUEST_TIMEOUT_MS and MAX_REQUEST_TIMEOUT_MS, so a slow server isn't taken for an unreachable one
+var REQUEST_TIMEOUT_MS = 4000;
+var MAX_REQUEST_TIMEOUT_MS = 20000;
+var REQUEST_TIMEOUT_FACTOR = 3;
+var REQUEST_TIME_SAMPLES = 8;
+var SYNC_HEARTBEAT_MS = 2000; // While syncing, how often the watch hears from us even if there's nothing to send
+
+// Commands the watch asks us to trace are timed from receipt to the start of the Indigo Server request
+// ("Phone"), through the request ("Indigo"), and from queueing the reply until the watch acknowledges it
+// ("Reply"). Each stage keeps a histogram over the buckets below (the last counting anything slower) and
+// its most recent samples for percentiles.
+var TRACE_STAGES = ["Phone", "Indigo", "Reply"];
+var TRACE_BUCKETS_MS = [50, 100, 250, 500, 1000, 2000, 5000];
+var TRACE_RECENT_SAMPLES = 32;
+
+// Which lists a could_not_connect message to the watch is about
+var COULD_NOT_CONNECT_DEVICES = 1;
+var COULD_NOT_CONNECT_ACTIONS = 2;
+
+// Which list the watch has on screen when it asks for the lists (from its main menu, the one selected to open next)
+var VISIBLE_LIST_DEVICES = 1;
+var VISIBLE_LIST_ACTIONS = 2;
+
+// While the watch app is open device state is polled, soon after a change was last seen and backing off
+// while nothing changes, and only rarely while the devices list isn't on the watch's screen
+var POLL_INTERVAL_MIN_MS = 5000;
+var POLL_INTERVAL_MAX_MS = 60000;
+var POLL_INTERVAL_HIDDEN_MS = 300000;
+
+// Whether a device can be switched on and off hardly ever changes, so it's cached by REST URL and a sync
+// only fetches the details of devices that are new, or whose cached entry is older than the TTL.
+// Bump the generation to drop every cached entry, e.g. if what's cached changes.
+var CAPABILITY_CACHE_TTL_MS = 7 * 24 * 60 * 60 * 1000;
+var CAPABILITY_CACHE_GENERATION = 1;
+
+// Toggles, dims and executes the Indigo Server can't be reached for are queued, kept in localStorage, and
+// replayed together once it answers again. The queue holds one command per device or action, the last one
+// asked for, and gives up on any still waiting after QUEUED_COMMAND_EXPIRY_MS. While anything is queued the
+// server is tried again after COMMAND_RETRY_MIN_MS, backing off to COMMAND_RETRY_MAX_MS, and an answer to
+// any other request replays the queue straight away.
+var QUEUED_COMMAND_EXPIRY_MS = 15 * 60 * 1000;
+var COMMAND_RETRY_MIN_MS = 5000;
+var COMMAND_RETRY_MAX_MS = 60000;
+
+var watchInboxSize = DEFAULT_WATCH_INBOX_SIZE;
+
+// A watch that can page its devices list tells us how many devices it can hold in full and how many rows
+// it holds of a paged list. When the Indigo Server has more devices than the watch can hold, only the rows
+// in the window the watch last told us about are sent.
+var watchMaxDevices = Infinity;
+var watchWindowSize = 0;
+var watchWindowStart = 0;
+var devicesPaged = false;
+
+// The list and range of its rows on the watch's screen as of its last request for the lists; those rows are
+// fetched ahead of the rest and sent in the interactive lane, so the screen fills in first however long the list
+var watchVisible = {list: 0, start: 0, count: 0};
+
+var fetchConcurrency = parseInt(localStorage.getItem("fetchConcurrency"), 10);
+if (!fetchConcurrency) {
+    fetchConcurrency = DEFAULT_FETCH_CONCURRENCY;
 }
 
-var devices = JSON.parse(localStorage.getItem("devices"));
-if (!devices) {
-    devices = [];
+// Read from localStorage by storeLoad() on first use
+var deviceCount = 0, devices = null;
+var actionCount = 0, actions = null;
+
+// {generation, entries: {restURL: {onOff, checked}}}, read by storeLoad()
+var deviceCapabilities = null;
+
+// Recent request times in ms, most recent last, by kind of request, read by storeLoad()
+var requestTimes = null;
+
+// Commands waiting for the Indigo Server to be reachable, by REST URL: {kind, number, query, queuedAt},
+// read by storeLoad()
+var commandQueue = null;
+
+// Devices and actions are kept in localStorage one record per key ("device:3", under the count in "deviceCount"),
+// and written behind: a change only marks its record (or the whole list, after a sync) dirty, and every change
+// made within STORE_FLUSH_DELAY_MS of the first is written together, only for records whose contents actually
+// changed. So a burst of toggles costs one small write per device, and a sync rewrites only what it changed.
+// Everything is read back on first use rather than at startup, so the watch hears we're ready without waiting
+// on it, and a sync reads the records only once its requests are out to the Indigo Server, so parsing a long
+// list overlaps waiting on the server. Other documents (the capability cache, request times, the command
+// queue) are written behind as a whole.
+var STORE_FLUSH_DELAY_MS = 1000;
+var storeWritten = {device: [], action: []}; // Each record's JSON as last read or written
+var storeDirty = {device: {}, action: {}, documents: {}}, storeFlushTimer = null;
+var storeDocuments = {
+    deviceCapabilities: function() { return deviceCapabilities; },
+    requestTimes: function() { return requestTimes; },
+    commandQueue: function() { return commandQueue; }
+};
+
+function storeRecords(kind) {
+    return (kind === "device") ? devices : actions;
 }
 
-var actionCount = localStorage.getItem("actionCount");
-if (!actionCount) {
-    actionCount = 0;
+// Read the records of the given kind, converting them from the single key that held the whole list before
+function storeLoadRecords(kind) {
+    var records = [], legacy = localStorage.getItem(kind + "s"), i, j;
+    if (legacy !== null) {
+        records = JSON.parse(legacy) || [];
+        localStorage.removeItem(kind + "s");
+        storeDirty[kind].all = true;
+        return records;
+    }
+    for (i = 0, j = parseInt(localStorage.getItem(kind + "Count"), 10) || 0; i < j; i += 1) {
+        var json = localStorage.getItem(kind + ":" + i);
+        if (json === null) {
+            break;
+        }
+        records.push(JSON.parse(json));
+        storeWritten[kind].push(json);
+    }
+    return records;
 }
 
-var actions = JSON.parse(localStorage.getItem("actions"));
-if (!actions) {
-    actions = [];
+// Read everything not read yet
+function storeLoad() {
+    storeLoadRequestDocuments();
+    if (devices !== null) {
+        return;
+    }
+    devices = storeLoadRecords("device");
+    deviceCount = devices.length;
+    actions = storeLoadRecords("action");
+    actionCount = actions.length;
+    deviceCapabilities = JSON.parse(localStorage.getItem("deviceCapabilities"));
+    if (!deviceCapabilities || (deviceCapabilities.generation !== CAPABILITY_CACHE_GENERATION)) {
+        deviceCapabilities = {generation: CAPABILITY_CACHE_GENERATION, entries: {}};
+    }
+    if (storeDirty.device.all || storeDirty.action.all) {
+        storeFlushLater();
+    }
+}
+
+// Read just what sending a request to the Indigo Server needs: the request times and the command queue, both small
+function storeLoadRequestDocuments() {
+    if (requestTimes !== null) {
+        return;
+    }
+    requestTimes = JSON.parse(localStorage.getItem("requestTimes")) || {};
+    commandQueue = JSON.parse(localStorage.getItem("commandQueue")) || {};
+    if (Object.keys(commandQueue).length > 0) {
+        commandQueueRetryLater();
+    }
+}
+
+// Note that the given record changed, or with no number that the whole list may have
+function storeRecordChanged(kind, number) {
+    storeDirty[kind][(number === undefined) ? "all" : number] = true;
+    storeFlushLater();
+}
+
+function storeDocumentChanged(name) {
+    storeDirty.documents[name] = true;
+    storeFlushLater();
+}
+
+function storeFlushLater() {
+    if (storeFlushTimer === null) {
+        storeFlushTimer = setTimeout(storeFlush, STORE_FLUSH_DELAY_MS);
+    }
+}
+
+function storeFlush() {
+    var writes = 0, kind, records, written, writtenLength, numbers, n, i, j, name;
+    storeFlushTimer = null;
+    for (kind in storeWritten) {
+        if (!storeWritten.hasOwnProperty(kind)) {
+            continue;
+        }
+        records = storeRecords(kind);
+        written = storeWritten[kind];
+        writtenLength = written.length;
+        numbers = storeDirty[kind].all ? null : Object.keys(storeDirty[kind]);
+        for (i = 0, j = numbers ? numbers.length : records.length; i < j; i += 1) {
+            n = numbers ? parseInt(numbers[i], 10) : i;
+            var json = (n < records.length) ? JSON.stringify(records[n]) : null;
+            if ((json !== null) && (json !== written[n])) {
+                localStorage.setItem(kind + ":" + n, json);
+                written[n] = json;
+                writes++;
+            }
+        }
+        // The list's length only changes with a sync, which marks the whole list
+        if (!numbers && (writtenLength !== records.length)) {
+            for (n = records.length; n < writtenLength; n += 1) {
+                localStorage.removeItem(kind + ":" + n);
+            }
+            written.length = records.length;
+            localStorage.setItem(kind + "Count", records.length);
+            writes++;
+        }
+        storeDirty[kind] = {};
+    }
+    for (name in storeDirty.documents) {
+        if (storeDirty.documents.hasOwnProperty(name)) {
+            localStorage.setItem(name, JSON.stringify(storeDocuments[name]()));
+            writes++;
+        }
+    }
+    storeDirty.documents = {};
+    console.log("Stored " + writes + " changes");
 }
 
 // Config approach using data URI adopted from: https://github.com/bertfreudenberg/PebbleONE/blob/c0b9ef6143a9f3655c5faa810baa88208eb6c1d8/src/js/pebble-js-app.js
@@ -62,7 +267,9 @@ var config_html; // see bottom of file
 
 var config = {
     serverAddress: "",
-    serverPort:    "8000"
+    serverPort:    "8000",
+    username:      "",
+    password:      ""
 };
 
 config.serverAddress = localStorage.getItem("serverAddress");
@@ -75,23 +282,48 @@ if (config.serverPort) {
     config.serverPort = "8000";
 }
 
+config.username = localStorage.getItem("username");
+if (!config.username) {
+    config.username = "";
+}
+
+config.password = localStorage.getItem("password");
+if (!config.password) {
+    config.password = "";
+}
+
 var prefixForGet = "http://" + config.serverAddress + ":" + config.serverPort;
 console.log("prefixForGet is: " + prefixForGet);
 
-// Set callback for the app ready event
+// Set callback for the app ready event; the watch waits for this before asking for its lists
 Pebble.addEventListener("ready", function(e) {
     console.log("Ready: " + e.ready);
     console.log(e.type);
+    send({"ready": 1}, {priority: PRIORITY_INTERACTIVE});
 });
 
+// The config as JSON for the single-quoted string the settings page parses it from. A password can hold
+// anything, so every character that could end the string (' or \) or the script (<) is written as a \u
+// escape, as are the line separators older JavaScript engines reject in a string.
+function configLiteral() {
+    return JSON.stringify(config).replace(/[\\'<\u2028\u2029]/g, function(c) {
+        return "\\u" + ("000" + c.charCodeAt(0).toString(16)).slice(-4);
+    });
+}
+
 Pebble.addEventListener("showConfiguration", function() {
     console.log("showing configuration");
-    var html = config_html.replace('__CONFIG__', JSON.stringify(config), 'g');
-    Pebble.openURL('data:text/html,' + encodeURI(html + '<!--.html'));
+    // Replaced through a function, so $ sequences in the config aren't read as replacement patterns
+    var html = config_html.replace('__CONFIG__', function() { return configLiteral(); });
+    // encodeURI leaves # alone, which would end the data URL's content and start a fragment
+    Pebble.openURL('data:text/html,' + encodeURI(html + '<!--.html').replace(/#/g, '%23'));
 });
 
 Pebble.addEventListener("webviewclosed", function(e) {
-    send({"loading": 1});
+    storeLoad();
+    // Nothing still on its way from or to the old server is of any use now
+    startGeneration(true);
+    send({"loading": 1}, {priority: PRIORITY_INTERACTIVE});
     console.log("configuration closed");
     // webview closed
     var options = JSON.parse(decodeURIComponent(e.response));
@@ -100,135 +332,1267 @@ Pebble.addEventListener("webviewclosed", function(e) {
     config.serverAddress = options.serverAddress;
     localStorage.setItem("serverPort", options.serverPort);
     config.serverPort = options.serverPort;
+    config.username = options.username || "";
+    localStorage.setItem("username", config.username);
+    config.password = options.password || "";
+    localStorage.setItem("password", config.password);
     prefixForGet = "http://" + config.serverAddress + ":" + config.serverPort;
-    getDevices();
-    getActions();
+    digestChallenge = null;
+    // Another server's devices may share REST URLs with the last one's, and commands queued for the last
+    // one are no longer wanted
+    deviceCapabilities.entries = {};
+    confirmedStates = {};
+    commandQueueClear();
+    // The watch starts its lists over from the top, asking for them once the loading message has it back
+    // on its top menu; fetching them here as well would only be aborted by that request
+    watchWindowStart = 0;
 });
 
-var messageQueue = [], queueInProgress = false, timeoutBackOff = DEFAULT_TIMEOUT_BACKOFF;
-function sendNextInQueue() {
-    if (messageQueue.length === 0) {
-        queueInProgress = false;
+// Messages to the watch wait in one of two lanes: interactive responses (toggle, dim and execute results)
+// go out ahead of bulk sync traffic, and each lane is sent in order
+var PRIORITY_INTERACTIVE = 0;
+var PRIORITY_BULK = 1;
+
+// Queue depth and wait times, plus how many messages it took to drain the queue and how long, so sync
+// strategies can be compared
+var queueStats = {
+    startTime: 0,
+    messageCount: 0,
+    supersededCount: 0,
+    maxDepth: 0,
+    totalWaitMs: 0,
+    maxWaitMs: 0
+};
+
+// How the current devices sync is going, from its start until the watch has the complete list: when the
+// watch got its first device row, and how many HTTP requests and messages to the watch it took. Logged as
+// each sync completes, so sync strategies (fetch concurrency, the capability cache, batching) can be
+// compared for a given Indigo install and device count.
+var syncStats = null;
+
+function syncStatsStart() {
+    syncStats = {
+        startedAt: Date.now(),
+        firstRowAt: null,
+        deviceListLength: 0, // Devices the Indigo Server listed
+        requests: 0,
+        messages: 0,
+        records: 0, // Device and action records sent, and their size packed and as keyed tuples
+        packedBytes: 0,
+        keyedBytes: 0
+    };
+}
+
+// The watch acknowledged a message
+function syncStatsSent(message) {
+    if (!syncStats) {
         return;
-    } else {
-        queueInProgress = true;
     }
-    var message = messageQueue[0];
-    Pebble.sendAppMessage(message,
+    syncStats.messages++;
+    if ((syncStats.firstRowAt === null) && message.device_records) {
+        syncStats.firstRowAt = Date.now();
+    }
+}
+
+// Returns the onSent callback for the message that ends the current sync, which logs how it went
+function syncStatsEnd(outcome) {
+    var stats = syncStats;
+    return function() {
+        if (syncStats !== stats) {
+            return;
+        }
+        console.log("Sync " + outcome + ": " + deviceCount + " of " + stats.deviceListLength + " devices, first row " +
+                    ((stats.firstRowAt !== null) ? (stats.firstRowAt - stats.startedAt) + " ms" : "none") +
+                    ", complete " + (Date.now() - stats.startedAt) + " ms, " + stats.messages + " messages, " +
+                    stats.requests + " requests (fetch concurrency " + fetchConcurrency + "), " + stats.records + " records at " +
+                    (stats.records ? (stats.packedBytes / stats.records).toFixed(1) + " bytes each (" +
+                     (stats.keyedBytes / stats.records).toFixed(1) + " as keyed tuples)" : "-"));
+        syncStats = null;
+    };
+}
+
+// By stage: {histogram: [count per bucket], recent: [ms], next: index of the oldest recent sample}
+var traceStats = {};
+
+function traceRecord(stage, ms) {
+    var stats = traceStats[stage];
+    if (!stats) {
+        stats = traceStats[stage] = {histogram: TRACE_BUCKETS_MS.map(function() { return 0; }).concat([0]), recent: [], next: 0};
+    }
+    var bucket = 0;
+    while ((bucket < TRACE_BUCKETS_MS.length) && (ms >= TRACE_BUCKETS_MS[bucket])) {
+        bucket++;
+    }
+    stats.histogram[bucket]++;
+    stats.recent[stats.next] = ms;
+    stats.next = (stats.next + 1) % TRACE_RECENT_SAMPLES;
+}
+
+// Nearest-rank percentile of a stage's recent samples
+function tracePercentile(stage, percent) {
+    var sorted = traceStats[stage].recent.slice().sort(function(a, b) { return a - b; });
+    return sorted[Math.max(Math.ceil(sorted.length * percent / 100) - 1, 0)];
+}
+
+// p50/p95 of each stage, one line per stage, for the watch's diagnostics window
+function traceSummary() {
+    return TRACE_STAGES.map(function(stage) {
+        return stage + " " + (traceStats[stage] ? tracePercentile(stage, 50) + "/" + tracePercentile(stage, 95) : "-");
+    }).join("\n");
+}
+
+// Log each stage's histogram and percentiles, e.g. to paste into a spreadsheet
+function dumpTraces() {
+    console.log("Trace buckets (ms): <" + TRACE_BUCKETS_MS.join(", <") + ", more");
+    TRACE_STAGES.forEach(function(stage) {
+        var stats = traceStats[stage];
+        if (stats) {
+            console.log("Trace " + stage + ": " + stats.histogram.join(", ") +
+                        "; p50 " + tracePercentile(stage, 50) + " ms, p95 " + tracePercentile(stage, 95) + " ms");
+        }
+    });
+}
+
+// A traced command's request to the Indigo Server is starting; trace is null for untraced commands
+function traceRequestStart(trace) {
+    if (trace) {
+        trace.requestStartAt = Date.now();
+        traceRecord("Phone", trace.requestStartAt - trace.receivedAt);
+    }
+}
+
+// A traced command's request to the Indigo Server is done; returns the callback to pass to send() with
+// its reply, to time how long the reply takes to reach the watch
+function traceRequestEnd(trace) {
+    if (!trace) {
+        return null;
+    }
+    var requestEndAt = Date.now();
+    traceRecord("Indigo", requestEndAt - trace.requestStartAt);
+    return function() {
+        traceRecord("Reply", Date.now() - requestEndAt);
+    };
+}
+
+var messageLanes = [[], []], messageInFlight = null, queueInProgress = false, timeoutBackOff = DEFAULT_TIMEOUT_BACKOFF;
+
+// Every sync and command belongs to a generation: the watch's session with the server as configured. A new
+// generation starts when the config changes or the watch asks for its lists again, and aborts whatever syncing
+// and polling the last one still has out to the Indigo Server and drops the messages it still has queued for
+// the watch, so nothing from an older sync can overwrite the new lists. The watch's commands, and the replies
+// telling it how they went, are only dropped along with the old server (commands is true): a new sync of the
+// same server leaves them to finish.
+var generation = 0;
+var requestsInFlight = []; // Each with an abort(), which drops the request without calling back, and whether it's a command
+
+function startGeneration(commands) {
+    generation++;
+    var aborted = requestsInFlight.filter(function(request) { return commands || !request.command; });
+    var dropped = queueDepth() + streamedDevices.length;
+    requestsInFlight = requestsInFlight.filter(function(request) { return aborted.indexOf(request) < 0; });
+    for (var i = 0, j = aborted.length; i < j; i += 1) {
+        aborted[i].abort();
+    }
+    messageLanes = [commands ? [] : messageLanes[PRIORITY_INTERACTIVE].filter(isCommandReply), []];
+    dropped -= messageLanes[PRIORITY_INTERACTIVE].length;
+    messageLanes[PRIORITY_INTERACTIVE].forEach(function(entry) { entry.generation = generation; });
+    streamedDevices = [];
+    // A sync aborted part way through leaves the watch showing the rows it rebuilt followed by the rest
+    // of the list it was replacing
+    if (syncPreviousDevices) {
+        devices = devices.concat(syncPreviousDevices.slice(devices.length));
+        deviceCount = devices.length;
+        syncPreviousDevices = null;
+    }
+    stopPolling();
+    pollInProgress = false;
+    devicesSyncing = false;
+    actionsSyncing = false;
+    if (commands) {
+        togglesInFlight = {};
+        dimsInFlight = {};
+        // Queued commands whose replay was aborted stay queued for the next one
+        if (commandReplayInProgress) {
+            commandReplayInProgress = false;
+            commandQueueRetryLater();
+        }
+    }
+    console.log("Generation " + generation + ": aborted " + aborted.length + " requests, dropped " + dropped + " queued messages");
+}
+
+// Whether a queued message tells the watch how one of its commands went (or carries a single record's new state),
+// rather than being part of a sync
+function isCommandReply(entry) {
+    var message = entry.message;
+    return Boolean(message.command_failed || message.command_queued || message.device || message.action ||
+                   message.hasOwnProperty("group_failed"));
+}
+
+function queueDepth() {
+    return messageLanes[PRIORITY_INTERACTIVE].length + messageLanes[PRIORITY_BULK].length;
+}
+
+function logQueueStats() {
+    console.log("Message queue drained: " + queueStats.messageCount + " messages in " + (Date.now() - queueStats.startTime) + " ms" +
+                ", " + queueStats.supersededCount + " superseded, max depth " + queueStats.maxDepth +
+                ", wait avg " + Math.round(queueStats.totalWaitMs / Math.max(queueStats.messageCount, 1)) + " ms" +
+                " max " + queueStats.maxWaitMs + " ms");
+}
+
+function transmitInFlight() {
+    Pebble.sendAppMessage(messageInFlight.message,
                               function (e) {
-                                console.log("Succesfully sent message: " + JSON.stringify(messageQueue[0]));
-                                // remove the current message from the queue then handle the next one
+                                console.log("Succesfully sent message: " + JSON.stringify(messageInFlight.message));
+                                // done with the current message, so handle the next one
                                 timeoutBackOff = DEFAULT_TIMEOUT_BACKOFF;
-                                messageQueue.shift();
+                                queueStats.messageCount++;
+                                syncStatsSent(messageInFlight.message);
+                                if (messageInFlight.onSent) {
+                                    messageInFlight.onSent();
+                                }
+                                messageInFlight = null;
                                 return sendNextInQueue();
                               },
                               function (e) {
-                                console.log("Failed to send message (will retry): " + JSON.stringify(messageQueue[0]));
-                                // repeat without removing the current message from the queue
+                                if (messageInFlight.generation !== generation) {
+                                    // Superseded while we were trying, so move on rather than retry
+                                    messageInFlight = null;
+                                    return sendNextInQueue();
+                                }
+                                console.log("Failed to send message (will retry): " + JSON.stringify(messageInFlight.message));
+                                // repeat the current message
                                 // using setTimeout with incremental backoff
                                 timeoutBackOff *= 2;
-                                setTimeout(sendNextInQueue, timeoutBackOff);
+                                setTimeout(transmitInFlight, timeoutBackOff);
                               }
                           );
 }
-function send(message) {
-    messageQueue.push(message);
+
+function sendNextInQueue() {
+    if (queueDepth() === 0) {
+        // Devices that arrived while we were busy go out together now that we're free
+        flushStreamedDevices();
+    }
+    var lane = (messageLanes[PRIORITY_INTERACTIVE].length > 0)? messageLanes[PRIORITY_INTERACTIVE] : messageLanes[PRIORITY_BULK];
+    if (lane.length === 0) {
+        queueInProgress = false;
+        logQueueStats();
+        return;
+    } else {
+        queueInProgress = true;
+    }
+    messageInFlight = lane.shift();
+    var waitMs = Date.now() - messageInFlight.queuedAt;
+    queueStats.totalWaitMs += waitMs;
+    queueStats.maxWaitMs = Math.max(queueStats.maxWaitMs, waitMs);
+    transmitInFlight();
+}
+
+// Give a newer update for the record identified by key (e.g. "device:3") to any queued-but-unsent messages
+// carrying that record: a single record update is replaced outright (taking onSent, if given, along with
+// it), and a batch is repacked with the record's new fields. Returns true if a single record update was
+// replaced, so nothing more needs sending.
+function supersedeQueued(key, message, fields, onSent) {
+    var replaced = false;
+    for (var lane = 0; lane < messageLanes.length; lane += 1) {
+        for (var i = 0, j = messageLanes[lane].length; i < j; i += 1) {
+            var entry = messageLanes[lane][i];
+            if (entry.key === key) {
+                entry.message = message;
+                entry.onSent = onSent || entry.onSent;
+                queueStats.supersededCount++;
+                replaced = true;
+            }
+            else if (entry.records && entry.records.index.hasOwnProperty(key)) {
+                entry.records.fields[entry.records.index[key]] = fields;
+                entry.message[entry.records.kind + "_records"] = packRecords(entry.records.fields);
+            }
+        }
+    }
+    return replaced;
+}
+
+// Queue a message for the watch. options (all optional) holds the priority (PRIORITY_BULK if not given),
+// the key and fields of the single record the message updates, or for a batch the records it carries
+// (records: their kind, the fields of each and the index of each in fields, by record key), and onSent,
+// called once the watch has the message.
+function send(message, options) {
+    options = options || {};
+    if (options.key && supersedeQueued(options.key, message, options.fields, options.onSent)) {
+        return;
+    }
+    var priority = (options.priority === undefined)? PRIORITY_BULK : options.priority;
+    messageLanes[priority].push({
+        message: message,
+        key: options.key,
+        records: options.records,
+        onSent: options.onSent,
+        generation: generation,
+        queuedAt: Date.now()
+    });
+    queueStats.maxDepth = Math.max(queueStats.maxDepth, queueDepth());
     if (!queueInProgress) {
+        queueStats.startTime = Date.now();
+        queueStats.messageCount = 0;
+        queueStats.supersededCount = 0;
+        queueStats.maxDepth = queueDepth();
+        queueStats.totalWaitMs = 0;
+        queueStats.maxWaitMs = 0;
         sendNextInQueue();
     }
 }
 
-function sendDeviceCount(deviceCount) {
+function recordKey(kind, number) {
+    return kind + ":" + number;
+}
+
+// Number of bytes the given value occupies as a tuple in a message to the watch
+function tupleSize(value) {
+    if (Array.isArray(value)) {
+        // Byte array
+        return TUPLE_HEADER_SIZE + value.length;
+    }
+    if (typeof value === "string") {
+        // UTF-8 encoded length plus the terminating null
+        return TUPLE_HEADER_SIZE + unescape(encodeURIComponent(value)).length + 1;
+    }
+    return TUPLE_HEADER_SIZE + INTEGER_SIZE;
+}
+
+function messageSize(message) {
+    var size = DICTIONARY_HEADER_SIZE;
+    for (var key in message) {
+        if (message.hasOwnProperty(key)) {
+            size += tupleSize(message[key]);
+        }
+    }
+    return size;
+}
+
+// The UTF-8 bytes of the given string, cut to at most maxLength without splitting a character
+function utf8Bytes(string, maxLength) {
+    var encoded = unescape(encodeURIComponent(string)), length = encoded.length, bytes = [], i;
+    if (length > maxLength) {
+        length = maxLength;
+        while ((length > 0) && ((encoded.charCodeAt(length) & 0xC0) === 0x80)) {
+            length--;
+        }
+    }
+    for (i = 0; i < length; i += 1) {
+        bytes.push(encoded.charCodeAt(i));
+    }
+    return bytes;
+}
+
+// Append to bytes the record with the given fields (as returned by encodeDevice or encodeAction),
+// following the record numbered previousNumber (-1 for the first)
+function packRecord(bytes, fields, previousNumber) {
+    var difference = fields[0] - (previousNumber + 1);
+    var zigzag = (difference < 0) ? (-2 * difference) - 1 : 2 * difference;
+    while (zigzag >= 0x80) {
+        bytes.push((zigzag & 0x7F) | 0x80);
+        zigzag = Math.floor(zigzag / 0x80);
+    }
+    bytes.push(zigzag);
+    var name = utf8Bytes(fields[1], MAX_RECORD_NAME_LENGTH);
+    bytes.push((name.length << 1) | (fields[2] ? RECORD_ON_BIT : 0) | (fields[3] ? RECORD_STALE_BIT : 0));
+    Array.prototype.push.apply(bytes, name);
+    return bytes;
+}
+
+function packRecords(recordFields) {
+    var bytes = [];
+    for (var i = 0, j = recordFields.length; i < j; i += 1) {
+        packRecord(bytes, recordFields[i], (i > 0) ? recordFields[i - 1][0] : -1);
+    }
+    return bytes;
+}
+
+// Send the given records of the given kind ("device" or "action") packing as many into each bulk
+// message as fit in the watch's inbox. header holds the tuples that lead the first message (e.g.
+// the count), trailer (optional) those that close the last one (e.g. the snapshot version), and
+// encodeRecord returns the array of field values for a record, starting with its number. The
+// messages go in the bulk lane unless another priority is given, and onSent (optional) is called
+// once the watch has the last of them.
+function sendRecordBatches(header, kind, records, encodeRecord, trailer, priority, onSent) {
+    var recordsKey = kind + "_records", message = header, messageRecords = {kind: kind, fields: [], index: {}}, bytes = [], i, j, f, key;
+    var size = messageSize(header) + tupleSize([]);
+    var trailerSize = trailer ? messageSize(trailer) - DICTIONARY_HEADER_SIZE : 0;
+    
+    for (i = 0, j = records.length; i < j; i += 1) {
+        var fields = encodeRecord(i, records[i]);
+        var count = messageRecords.fields.length;
+        var recordSize = packRecord([], fields, (count > 0) ? messageRecords.fields[count - 1][0] : -1).length;
+        
+        // Always place at least one record in a message, even if it overflows the estimate;
+        // the last record must leave room for the trailer
+        if ((count > 0) && (size + recordSize + ((i === j - 1) ? trailerSize : 0) > watchInboxSize)) {
+            message[recordsKey] = bytes;
+            send(message, {priority: priority, records: messageRecords});
+            message = {};
+            messageRecords = {kind: kind, fields: [], index: {}};
+            bytes = [];
+            size = messageSize(message) + tupleSize([]);
+            count = 0;
+        }
+        
+        var recordStart = bytes.length;
+        packRecord(bytes, fields, (count > 0) ? messageRecords.fields[count - 1][0] : -1);
+        messageRecords.index[recordKey(kind, fields[0])] = count;
+        messageRecords.fields.push(fields);
+        size += bytes.length - recordStart;
+        if (syncStats) {
+            syncStats.records++;
+            syncStats.packedBytes += bytes.length - recordStart;
+            for (f = 0; f < fields.length; f += 1) {
+                syncStats.keyedBytes += tupleSize(fields[f]);
+            }
+        }
+    }
+    
+    for (key in trailer) {
+        if (trailer.hasOwnProperty(key)) {
+            message[key] = trailer[key];
+        }
+    }
+    if ((bytes.length > 0) || (messageSize(message) > DICTIONARY_HEADER_SIZE)) {
+        if (bytes.length > 0) {
+            message[recordsKey] = bytes;
+        }
+        send(message, {priority: priority, records: messageRecords, onSent: onSent});
+    }
+}
+
+// Version of a list of records as the watch holds it, so the watch can tell us which list it
+// already has; hashes each record's fields with 32 bit FNV-1a, kept positive and non-zero
+// since the watch reports 0 when it has no usable snapshot
+function snapshotVersion(records, encodeRecord) {
+    var hash = 0x811c9dc5 | 0, i, j, f, c;
+    for (i = 0, j = records.length; i < j; i += 1) {
+        var fields = encodeRecord(i, records[i]);
+        for (f = 0; f < fields.length; f += 1) {
+            var field = fields[f].toString() + "\u0000";
+            for (c = 0; c < field.length; c += 1) {
+                hash ^= field.charCodeAt(c);
+                // hash *= FNV prime, in 32 bit arithmetic
+                hash = (hash + (hash << 1) + (hash << 4) + (hash << 7) + (hash << 8) + (hash << 24)) | 0;
+            }
+        }
+    }
+    return (hash & 0x7fffffff) || 1;
+}
+
+function encodeDevice(deviceNumber, deviceInfo) {
+    return [deviceNumber, deviceInfo.device_name, deviceInfo.device_on ? 1 : 0, deviceConfirmed(deviceInfo) ? 0 : 1];
+}
+
+function encodeAction(actionNumber, actionInfo) {
+    return [actionNumber, actionInfo.action_name];
+}
+
+// The watch restores every state in its snapshot as stale, so whether one is confirmed isn't part of the version
+function devicesSnapshotVersion() {
+    return snapshotVersion(devices, function(deviceNumber, deviceInfo) {
+        return encodeDevice(deviceNumber, deviceInfo).slice(0, 3);
+    });
+}
+
+function actionsSnapshotVersion() {
+    return snapshotVersion(actions, encodeAction);
+}
+
+// Rows of the given list on the watch's screen
+function visibleRows(list) {
+    var rows = [];
+    if (watchVisible.list === list) {
+        for (var row = watchVisible.start; row < watchVisible.start + watchVisible.count; row += 1) {
+            rows.push(row);
+        }
+    }
+    return rows;
+}
+
+// Send records as sendRecordBatches does, but those of rows on the watch's screen go ahead of the rest in the
+// interactive lane, led by the header. The trailer (e.g. a snapshot version) always closes the bulk lane, so it
+// still follows every record of the list queued before it.
+function sendVisibleFirst(header, kind, list, records, encodeRecord, trailer, onSent) {
+    var rows = visibleRows(list);
+    var visible = records.filter(function(record) { return rows.indexOf(record) >= 0; });
+    var rest = records.filter(function(record) { return rows.indexOf(record) < 0; });
+    var visibleLast = (visible.length > 0) && (rest.length === 0) && !trailer;
+    if (visible.length > 0) {
+        sendRecordBatches(header, kind, visible, encodeRecord, null, PRIORITY_INTERACTIVE, visibleLast ? onSent : null);
+        header = {};
+    }
+    if (!visibleLast) {
+        sendRecordBatches(header, kind, rest, encodeRecord, trailer, PRIORITY_BULK, onSent);
+    }
+}
+
+// While a sync rebuilds the devices list, the list it replaces; the watch still shows these devices in the
+// rows the sync hasn't reached yet
+var syncPreviousDevices = null;
+
+// The device the watch shows in the given row, or undefined if we hold none there (the watch may ask about
+// a row we don't have, e.g. one restored from its snapshot that the server has since dropped)
+function deviceAt(deviceNumber) {
+    if (deviceNumber < deviceCount) {
+        return devices[deviceNumber];
+    }
+    return syncPreviousDevices ? syncPreviousDevices[deviceNumber] : undefined;
+}
+
+// Number of the device or action ("device" or "action") with the given REST URL, trying number first;
+// -1 if the list doesn't have it (a sync may have moved or dropped it since it was asked about)
+function recordNumberOf(kind, restURL, number) {
+    var records = storeRecords(kind), field = kind + "_rest_url";
+    if (records[number] && (records[number][field] === restURL)) {
+        return number;
+    }
+    for (var i = 0, j = records.length; i < j; i += 1) {
+        if (records[i][field] === restURL) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// A command for the device the watch showed in the given row went through: keep its new state, and send it to
+// the watch in the device's row as of now
+function deviceCommandDone(deviceNumber, device, isOn, onSent) {
+    device.device_on = isOn;
+    confirmedStates[device.device_rest_url] = true;
+    var current = recordNumberOf("device", device.device_rest_url, deviceNumber);
+    if (current >= 0) {
+        devices[current].device_on = isOn;
+        sendDeviceInfo(current, devices[current], onSent);
+        storeRecordChanged("device", current);
+    }
+    else if (deviceAt(deviceNumber) === device) {
+        // Not reached yet by the sync rebuilding the list, which takes the new state from this record
+        sendDeviceInfo(deviceNumber, device, onSent);
+    }
+}
+
+// Whether the watch holds the given device; it holds every device unless the list is paged
+function deviceInWatchWindow(deviceNumber) {
+    return !devicesPaged || ((deviceNumber >= watchWindowStart) && (deviceNumber < watchWindowStart + watchWindowSize));
+}
+
+// Tell the watch the Indigo Server couldn't be reached (or refused us) for the given lists, so it can say so
+// straight away rather than wait out its own timeout
+function sendCouldNotConnect(lists, onSent) {
+    send({"could_not_connect": lists}, {priority: PRIORITY_INTERACTIVE, onSent: onSent});
+}
+
+function sendDeviceCount(deviceCount, onSent) {
     send({"device_count_complete": 1,
-        "device_count": deviceCount});
+        "device_count": deviceCount}, {onSent: onSent});
+}
+
+// Send an update for a single device, ahead of any bulk sync and replacing any older update still queued for it;
+// onSent (optional) is called once the watch has it
+function sendDeviceInfo(deviceNumber, deviceInfo, onSent) {
+    if (!deviceInWatchWindow(deviceNumber)) {
+        return;
+    }
+    var fields = encodeDevice(deviceNumber, deviceInfo);
+    var message = {"device": 1,
+        "device_records": packRecords([fields])};
+    if (!devicesPaged) {
+        message.device_snapshot_version = devicesSnapshotVersion();
+    }
+    send(message, {priority: PRIORITY_INTERACTIVE, key: recordKey("device", deviceNumber), fields: fields, onSent: onSent});
+}
+
+// Devices whose details have arrived but that have not yet been handed to the message queue,
+// and the device count last sent with them
+var streamedDevices = [], watchDeviceCount = 0;
+
+// The most devices the sync in progress can turn up: every listed device not known to lack on/off. It goes
+// out with the sync's first count so the watch can make room for them all at once.
+var expectedDeviceCount = null;
+
+// Queue a device for sending to the watch; it goes out straight away if the queue is idle,
+// otherwise it is batched with any others that arrive before the queue drains
+function streamDevice(deviceNumber) {
+    streamedDevices.push(deviceNumber);
+    if (!queueInProgress) {
+        flushStreamedDevices();
+    }
+}
+
+// Send all streamed devices, along with the count of devices known so far so the watch can grow its list.
+// Once every device has been streamed, the final flush carries the complete count and snapshot version,
+// and goes out even with no devices left to send to tell the watch that its list is current; partial marks
+// a list missing devices whose details couldn't be fetched.
+function flushStreamedDevices(complete, partial) {
+    if ((streamedDevices.length === 0) && !complete) {
+        return;
+    }
+    var deviceNumbers = streamedDevices.filter(deviceInWatchWindow);
+    streamedDevices = [];
+    // Rows outside the window of a paged list aren't sent, so only tell the watch the list grew
+    // once it has grown by a window's worth
+    if (devicesPaged && !complete && (deviceNumbers.length === 0) && (deviceCount < watchDeviceCount + watchWindowSize)) {
+        return;
+    }
+    watchDeviceCount = deviceCount;
+    var header = complete ? {"device_count_complete": 1, "device_count": deviceCount} : {"device_count": deviceCount};
+    if (devicesPaged) {
+        header.device_paged = 1;
+    }
+    else if (expectedDeviceCount !== null) {
+        header.device_count_expected = expectedDeviceCount;
+        expectedDeviceCount = null;
+    }
+    if (partial) {
+        header.devices_partial = 1;
+    }
+    sendVisibleFirst(header, "device", VISIBLE_LIST_DEVICES, deviceNumbers,
+                     function(i, deviceNumber) {
+                         return encodeDevice(deviceNumber, devices[deviceNumber]);
+                     },
+                     (complete && !devicesPaged) ? {"device_snapshot_version": devicesSnapshotVersion()} : null,
+                     complete ? syncStatsEnd("complete") : null);
+}
+
+// The watch scrolled its paged devices list, so send the rows that came into its window
+function moveWatchWindow(start) {
+    var previousStart = watchWindowStart;
+    watchWindowStart = start;
+    if (!devicesPaged) {
+        return;
+    }
+    var deviceNumbers = [];
+    for (var i = start, j = Math.min(start + watchWindowSize, deviceCount); i < j; i += 1) {
+        if ((i < previousStart) || (i >= previousStart + watchWindowSize)) {
+            deviceNumbers.push(i);
+        }
+    }
+    sendRecordBatches({}, "device", deviceNumbers,
+                      function(i, deviceNumber) {
+                          return encodeDevice(deviceNumber, devices[deviceNumber]);
+                      },
+                      null, PRIORITY_INTERACTIVE);
+    // Only the window is polled, so the rows that just came into it are polled soon
+    if (pollTimer !== null) {
+        pollInterval = POLL_INTERVAL_MIN_MS;
+        schedulePoll();
+    }
+}
+
+// The Indigo Server uses HTTP digest authentication when it has a username set. Rather than take a
+// 401 round trip on every request, the server's last challenge is kept and each request carries its
+// answer up front, counting up the nonce count (nc) as the nonce is reused; a fresh challenge is
+// only needed when the server retires the nonce.
+var digestChallenge = null; // realm, nonce, qop and opaque of the last challenge, plus our HA1 for its realm
+var digestNonceCount = 0; // Requests answered with the current nonce
+
+function md5(value) {
+    return crypto.createHash('md5').update(value).digest('hex');
+}
+
+// Parse the parameters of a WWW-Authenticate: Digest header; returns null for anything else
+function parseDigestChallenge(header) {
+    var start = header ? header.indexOf("Digest ") : -1;
+    if (start < 0) {
+        return null;
+    }
+    var challenge = {}, param = /(\w+)=(?:"([^"]*)"|([^\s,]*))/g, match;
+    header = header.substring(start + "Digest ".length);
+    while ((match = param.exec(header)) !== null) {
+        challenge[match[1]] = (match[2] !== undefined) ? match[2] : match[3];
+    }
+    if (!challenge.nonce || (challenge.algorithm && (challenge.algorithm.toUpperCase() !== "MD5"))) {
+        return null;
+    }
+    challenge.ha1 = md5(config.username + ":" + challenge.realm + ":" + config.password);
+    return challenge;
+}
+
+// Authorization header answering the cached challenge for a request of the given method and URI
+function digestAuthorization(method, uri) {
+    var challenge = digestChallenge;
+    var qop = (challenge.qop && (challenge.qop.split(",").indexOf("auth") >= 0)) ? "auth" : null;
+    var ha2 = md5(method + ":" + uri);
+    var header = 'Digest username="' + config.username + '", realm="' + challenge.realm + '", nonce="' + challenge.nonce + '", uri="' + uri + '"';
+    if (qop) {
+        digestNonceCount++;
+        var nc = ("0000000" + digestNonceCount.toString(16)).slice(-8);
+        var cnonce = md5(Math.random().toString(36) + Date.now()).substring(0, 16);
+        header += ', qop=' + qop + ', nc=' + nc + ', cnonce="' + cnonce + '", response="' + md5([challenge.ha1, challenge.nonce, nc, cnonce, qop, ha2].join(":")) + '"';
+    } else {
+        header += ', response="' + md5([challenge.ha1, challenge.nonce, ha2].join(":")) + '"';
+    }
+    if (challenge.opaque) {
+        header += ', opaque="' + challenge.opaque + '"';
+    }
+    return header;
+}
+
+// Kind of request the given path makes, for timing: a list ("/devices.json") or any one record's details ("/devices/")
+function requestKind(path) {
+    return path.split("?")[0].replace(/^(\/[^\/]+\/).*$/, "$1");
+}
+
+// How long to wait for a request of the given kind, from how long the last few took
+function requestTimeout(kind) {
+    var slowest = Math.max.apply(null, (requestTimes[kind] || []).concat([0]));
+    return Math.min(Math.max(slowest * REQUEST_TIMEOUT_FACTOR, REQUEST_TIMEOUT_MS), MAX_REQUEST_TIMEOUT_MS);
+}
+
+function requestTimeRecord(kind, ms) {
+    var times = requestTimes[kind] = requestTimes[kind] || [];
+    times.push(ms);
+    if (times.length > REQUEST_TIME_SAMPLES) {
+        times.shift();
+    }
+}
+
+// Whether the last request to the Indigo Server that finished got an answer
+var indigoReachable = true;
+
+// GET the given path from the Indigo Server, authenticating if we have credentials. onload(req) is called
+// with the final response and onerror(req), if given, when the request never got one, including when it
+// went past its deadline (see requestTimeout); a request that runs out of time counts as taking all of it,
+// so the next one of its kind gets longer. prepareRequest(req), if given, is called before each attempt is sent, e.g.
+// to add headers. command is true for a command from the watch, which only a change of server aborts (see
+// startGeneration). Neither callback is called if the request is aborted by a new generation.
+function indigoGet(path, onload, onerror, prepareRequest, command) {
+    var challenged = false, finished = false, req = null;
+    var kind = requestKind(path), startedAt = Date.now(), timeout = requestTimeout(kind);
+    var request = {
+        command: Boolean(command),
+        abort: function() {
+            finish();
+            req.abort();
+        }
+    };
+    var deadline = setTimeout(function() {
+        console.log("Request for " + path + " timed out after " + timeout + " ms");
+        request.abort();
+        requestTimeRecord(kind, timeout);
+        storeDocumentChanged("requestTimes");
+        indigoReachable = false;
+        if (onerror) {
+            onerror(req);
+        }
+    }, timeout);
+    requestsInFlight.push(request);
+    
+    function finish() {
+        finished = true;
+        clearTimeout(deadline);
+        var index = requestsInFlight.indexOf(request);
+        if (index >= 0) {
+            requestsInFlight.splice(index, 1);
+        }
+    }
+    
+    function attempt() {
+        if (syncStats) {
+            syncStats.requests++;
+        }
+        req = new XMLHttpRequest();
+        var answered = (config.username !== "") && (digestChallenge !== null);
+        req.open('GET', prefixForGet + path, true);  // `true` makes the request asynchronous
+        if (answered) {
+            req.setRequestHeader("Authorization", digestAuthorization("GET", path));
+        }
+        if (prepareRequest) {
+            prepareRequest(req);
+        }
+        req.onload = function(e) {
+            if (finished) {
+                return;
+            }
+            if ((req.status == 401) && (config.username !== "") && !challenged) {
+                // Take one more try when we had no challenge yet, or the server retired our nonce; a
+                // rejection of a current nonce means the credentials are wrong
+                var challenge = parseDigestChallenge(req.getResponseHeader("WWW-Authenticate"));
+                if (challenge && (!answered || (challenge.stale === "true") || (challenge.nonce !== digestChallenge.nonce))) {
+                    challenged = true;
+                    if (!digestChallenge || (challenge.nonce !== digestChallenge.nonce)) {
+                        digestChallenge = challenge;
+                        digestNonceCount = 0;
+                    }
+                    attempt();
+                    return;
+                }
+            }
+            finish();
+            requestTimeRecord(kind, Date.now() - startedAt);
+            commandQueueServerAnswered();
+            onload(req);
+        };
+        req.onerror = function(e) {
+            if (finished) {
+                return;
+            }
+            finish();
+            indigoReachable = false;
+            if (onerror) {
+                onerror(req);
+            }
+        };
+        req.send(null);
+    }
+    
+    attempt();
+}
+
+// Fetch each of the given URLs with at most concurrency requests in flight. onResult(index, status, responseText, req)
+// is called in index order, as soon as every earlier URL has finished, and onComplete once all of them have.
+// Failed requests are reported with their status (0 if the request never got a response). prepareRequest(index, req),
+// if given, is called on each request before it is sent, e.g. to add headers. first, if given, lists the indexes
+// of URLs to request ahead of the rest, and onFirstResult(index, status, responseText), if given, is called as
+// each of them arrives, ahead of its turn in index order. command is passed on to indigoGet.
+function fetchInOrder(urls, concurrency, onResult, onComplete, prepareRequest, first, onFirstResult, command) {
+    var results = [], order = [], nextToRequest = 0, nextToReport = 0, i;
+    
+    var requested = {};
+    first = first || [];
+    first.concat(urls.map(function(url, index) { return index; })).forEach(function(index) {
+        if (!requested[index]) {
+            requested[index] = true;
+            order.push(index);
+        }
+    });
+    
+    function report() {
+        while ((nextToReport < urls.length) && results[nextToReport]) {
+            onResult(nextToReport, results[nextToReport].status, results[nextToReport].responseText, results[nextToReport].req);
+            results[nextToReport] = true; // Release the response text
+            nextToReport++;
+        }
+        if (nextToReport === urls.length) {
+            onComplete();
+        }
+    }
+    
+    function requestNext() {
+        if (nextToRequest >= urls.length) {
+            return;
+        }
+        var index = order[nextToRequest++];
+        indigoGet(urls[index],
+            function(req) {
+                results[index] = {status: req.status, responseText: req.responseText, req: req};
+                if (onFirstResult && (first.indexOf(index) >= 0)) {
+                    onFirstResult(index, req.status, req.responseText);
+                }
+                requestNext();
+                report();
+            },
+            function(req) {
+                results[index] = {status: 0, responseText: "", req: req};
+                requestNext();
+                report();
+            },
+            prepareRequest && function(req) {
+                prepareRequest(index, req);
+            },
+            command);
+    }
+    
+    if (urls.length === 0) {
+        onComplete();
+        return;
+    }
+    for (i = 0; i < concurrency; i += 1) {
+        requestNext();
+    }
 }
 
-function sendDeviceInfo(deviceNumber, deviceInfo) {
-    send({"device": 1,
-        "device_number": deviceNumber,
-        "device_name": deviceInfo.device_name,
-        "device_on": deviceInfo.device_on});
+// While a sync waits on the Indigo Server, the watch is sent a heartbeat every SYNC_HEARTBEAT_MS unless other
+// messages are going out anyway, so it can tell a slow server from a phone that has gone away
+var syncHeartbeatTimer = null;
+
+function syncHeartbeatStart() {
+    if (syncHeartbeatTimer !== null) {
+        return;
+    }
+    syncHeartbeatTimer = setInterval(function() {
+        if (!devicesSyncing && !actionsSyncing) {
+            clearInterval(syncHeartbeatTimer);
+            syncHeartbeatTimer = null;
+            return;
+        }
+        if (!queueInProgress) {
+            send({"sync_progress": 1}, {priority: PRIORITY_INTERACTIVE});
+        }
+    }, SYNC_HEARTBEAT_MS);
 }
 
-function getDevices() {
-    var req = new XMLHttpRequest();
+// Get the devices from the Indigo Server. If watchSnapshotVersion matches the devices we last sent, the
+// watch already holds them, so only devices that were inserted, changed or removed since are sent.
+function getDevices(watchSnapshotVersion) {
+    // A full sync brings every device up to date, so polling picks up again once it's done
+    stopPolling();
+    devicesSyncing = true;
+    syncHeartbeatStart();
+    syncStatsStart();
+    
     // Get the list of all devices known to the Indigo Server
-    req.open('GET', prefixForGet + "/devices.json", true);  // `true` makes the request asynchronous
-    // Indigo uses Digest authentication, so this won't work:
-    //    req.setRequestHeader("Authorization", "Basic " + btoa(username + ":" + password))
-    // Instead, see http://stackoverflow.com/questions/10937890/javascript-digest-manually-authentication?rq=1
-    // TODO: Support Digest Authentication
-    req.onload = function(e) {
+    indigoGet("/devices.json", function(req) {
         if(req.status == 200) {
             var response = JSON.parse(req.responseText);
+            if (syncStats) {
+                syncStats.deviceListLength = response.length;
+            }
             if (response.length > 0) {
+                devicesPaged = (watchWindowSize > 0) && (response.length > watchMaxDevices);
+                
                 // Pare down to just devices that have typeSupportsOnOff: true
+                var watchDevices = (watchSnapshotVersion === devicesSnapshotVersion())? devices : [];
+                var previousDevices = syncPreviousDevices = devices, knownDevices = {}, i, j;
+                for (i = 0, j = devices.length; i < j; i += 1) {
+                    knownDevices[devices[i].device_rest_url] = devices[i];
+                }
                 deviceCount = 0;
+                watchDeviceCount = 0;
                 devices = [];
                 
-                var i, j;
+                // The watch restored its rows from its snapshot, so shows every state as stale; a row is
+                // sent if it changed, or if its state has been confirmed and the watch hasn't been told
+                var watchConfirmedRows = {};
+                var addDevice = function(listing, on) {
+                    devices[deviceCount] =
+                    {
+                        "device_name": listing.name.substring(0, MAX_DEVICE_NAME_LENGTH),
+                        "device_rest_url": listing.restURL,
+                        "device_on": on
+                    };
+                    deviceCount++;
+                    
+                    var watchDevice = watchDevices[deviceCount - 1];
+                    if (!watchDevice ||
+                        (watchDevice.device_name !== devices[deviceCount - 1].device_name) ||
+                        (watchDevice.device_on !== devices[deviceCount - 1].device_on) ||
+                        (deviceConfirmed(devices[deviceCount - 1]) && !watchConfirmedRows[deviceCount - 1])) {
+                        streamDevice(deviceCount - 1);
+                    }
+                };
+                
+                // A device's details are only needed if its capability isn't cached, has expired, or it can be
+                // switched but we don't know its state yet; otherwise the name comes from the listing and
+                // the state from our last sync, and polling brings the state up to date
+                var now = Date.now(), entries = {}, fetchIndexes = [], restURLs = [], cachedCount = 0, missingCount = 0;
+                var usable = function(listing) {
+                    var entry = deviceCapabilities.entries[listing.restURL];
+                    return entry && (!entry.onOff || knownDevices.hasOwnProperty(listing.restURL));
+                };
                 for (i = 0, j = response.length; i < j; i += 1) {
-                    var deviceRequest = new XMLHttpRequest();
-                    deviceRequest.open('GET', prefixForGet + response[i].restURL, false);  // `false` makes the request synchronous
-                    deviceRequest.send(null);
-                    if( deviceRequest.status == 200) {
-                        // Track device information
-                        var deviceInfo = JSON.parse(deviceRequest.responseText);
-                        if (deviceInfo.typeSupportsOnOff) {
-                            devices[deviceCount] =
-                            {
-                                "device_name": deviceInfo.name.substring(0, MAX_DEVICE_NAME_LENGTH),
-                                "device_rest_url": response[i].restURL,
-                                "device_on": deviceInfo.isOn
-                            };
-                            deviceCount++;
-                        }
+                    var entry = deviceCapabilities.entries[response[i].restURL];
+                    if (entry) {
+                        entries[response[i].restURL] = entry;
                     }
-                    else {
-                        console.log("Request for device " + response[i].restURL + " returned error code " + deviceRequest.status.toString());
+                    if (usable(response[i]) && (now - entry.checked < CAPABILITY_CACHE_TTL_MS)) {
+                        cachedCount++;
+                    } else {
+                        fetchIndexes.push(i);
+                        restURLs.push(response[i].restURL);
                     }
                 }
-                localStorage.setItem("deviceCount", deviceCount);
-                localStorage.setItem("devices", JSON.stringify(devices));
+                // Forget devices the server no longer has
+                deviceCapabilities.entries = entries;
+                expectedDeviceCount = response.filter(function(listing) {
+                    return !entries.hasOwnProperty(listing.restURL) || entries[listing.restURL].onOff;
+                }).length;
                 
-                // We've got the total count of controllable devices, so send it out
-                sendDeviceCount(deviceCount);
+                // The rows on the watch's screen were these devices as of our last sync, so fetch them first. A row
+                // the watch already holds is updated as soon as its device arrives, rather than once every device
+                // above it has; should the rows have moved since, the update is put right as the sync streams past.
+                var firstFetches = [], rowOfFetch = {};
+                visibleRows(VISIBLE_LIST_DEVICES).forEach(function(row) {
+                    var k = previousDevices[row] ? restURLs.indexOf(previousDevices[row].device_rest_url) : -1;
+                    if (k >= 0) {
+                        firstFetches.push(k);
+                        rowOfFetch[k] = row;
+                    }
+                });
+                var updateVisibleRow = function(k, status, responseText) {
+                    var row = rowOfFetch[k], watchDevice = watchDevices[row];
+                    if ((status != 200) || !watchDevice || (watchDevice.device_rest_url !== restURLs[k]) || !deviceInWatchWindow(row)) {
+                        return;
+                    }
+                    var deviceInfo = JSON.parse(responseText);
+                    var device = {
+                        "device_name": deviceInfo.name.substring(0, MAX_DEVICE_NAME_LENGTH),
+                        "device_rest_url": restURLs[k],
+                        "device_on": deviceInfo.isOn
+                    };
+                    if (deviceInfo.typeSupportsOnOff) {
+                        // Even an unchanged row goes, to confirm the state the watch shows as stale
+                        confirmedStates[restURLs[k]] = true;
+                        watchDevices[row] = device;
+                        watchConfirmedRows[row] = true;
+                        send({"device_records": packRecords([encodeDevice(row, device)])}, {priority: PRIORITY_INTERACTIVE});
+                    }
+                };
                 
-                // Now send out the information for each device
-                for (i = 0, j = devices.length; i < j; i += 1) {
-                    sendDeviceInfo(i, devices[i]);
-                }
+                // Add devices up to (not including) the given one from the cache
+                var next = 0;
+                var addCachedUpTo = function(end) {
+                    for (; next < end; next += 1) {
+                        var entry = deviceCapabilities.entries[response[next].restURL];
+                        if (entry && entry.onOff) {
+                            addDevice(response[next], knownDevices[response[next].restURL].device_on);
+                        }
+                    }
+                };
+                
+                // Fetch the details of the devices that need them, streaming each controllable device to the watch
+                // as soon as it and the devices before it have arrived so the watch's list fills in top down
+                fetchInOrder(restURLs, fetchConcurrency,
+                    function(k, status, responseText) {
+                        i = fetchIndexes[k];
+                        addCachedUpTo(i);
+                        next = i + 1;
+                        if (status == 200) {
+                            // Track device information
+                            var deviceInfo = JSON.parse(responseText);
+                            deviceCapabilities.entries[restURLs[k]] = {onOff: !!deviceInfo.typeSupportsOnOff, checked: now};
+                            if (deviceInfo.typeSupportsOnOff) {
+                                confirmedStates[restURLs[k]] = true;
+                                addDevice({name: deviceInfo.name, restURL: restURLs[k]}, deviceInfo.isOn);
+                            }
+                        }
+                        else {
+                            console.log("Request for device " + restURLs[k] + " returned error code " + status.toString());
+                            // Fall back on an expired entry rather than drop the device
+                            if (usable(response[i])) {
+                                next = i;
+                                addCachedUpTo(i + 1);
+                            }
+                            else {
+                                missingCount++;
+                            }
+                        }
+                    },
+                    function() {
+                        addCachedUpTo(response.length);
+                        syncPreviousDevices = null;
+                        // Commands queued for devices the sync hadn't reached yet can go now
+                        commandQueueServerAnswered();
+                        console.log("Synced " + response.length + " devices, " + cachedCount + " from the capability cache, " + missingCount + " missing");
+                        storeRecordChanged("device");
+                        storeDocumentChanged("deviceCapabilities");
+                        storeDocumentChanged("requestTimes");
+                        
+                        // Every device has been streamed, so send out the final count of controllable devices
+                        flushStreamedDevices(true, missingCount > 0);
+                        devicesSyncing = false;
+                        pollInterval = POLL_INTERVAL_MIN_MS;
+                        schedulePoll();
+                    }, null, firstFetches, updateVisibleRow);
             }
             else {
-                sendDeviceCount(0);
+                devicesSyncing = false;
+                devicesPaged = false;
+                sendDeviceCount(0, syncStatsEnd("complete"));
             }
         } else {
             console.log("Request returned error code " + req.status.toString());
-            sendDeviceCount(0);
+            devicesSyncing = false;
+            sendCouldNotConnect(COULD_NOT_CONNECT_DEVICES, syncStatsEnd("failed"));
         }
+    }, function(req) {
+        console.log("Devices request failed");
+        devicesSyncing = false;
+        sendCouldNotConnect(COULD_NOT_CONNECT_DEVICES, syncStatsEnd("failed"));
+    });
+}
+
+// Device state can change behind our back (schedules, triggers, other clients), so while the watch app is
+// open it is polled and any device whose on/off state changed is sent through the usual device message,
+// as is any the poll confirms for the first time (see confirmedStates).
+// The requests carry the validators from each device's last response, so a server that supports them
+// only sends details that changed. There is no need to stop polling when the watch app closes, as this
+// script stops running with it.
+var devicesSyncing = false;
+var devicesVisible = false;
+var pollInterval = POLL_INTERVAL_MIN_MS, pollTimer = null, pollInProgress = false;
+var deviceValidators = {}; // ETag and Last-Modified of the last response, by device REST URL
+
+// REST URLs of the devices whose on/off state has come from the Indigo Server since this script started. Any
+// other device's state is the one stored by an earlier run, as the watch's snapshot is, so it's sent marked
+// stale and the watch shows it as the last known state until a sync, poll or command confirms it.
+var confirmedStates = {};
+
+function deviceConfirmed(device) {
+    return confirmedStates.hasOwnProperty(device.device_rest_url);
+}
+var togglesInFlight = {}; // By device number; polled state is ignored while a toggle or dim is on its way
+
+function stopPolling() {
+    if (pollTimer !== null) {
+        clearTimeout(pollTimer);
+        pollTimer = null;
+    }
+}
+
+function schedulePoll() {
+    stopPolling();
+    if (devicesSyncing || pollInProgress || (deviceCount === 0)) {
+        return;
+    }
+    pollTimer = setTimeout(pollDevices, devicesVisible ? pollInterval : Math.max(pollInterval, POLL_INTERVAL_HIDDEN_MS));
+}
+
+function pollDevices() {
+    pollTimer = null;
+    if (devicesSyncing || pollInProgress) {
+        return;
+    }
+    pollInProgress = true;
+    
+    // The watch only holds the window of a paged list, so there's no point polling the rest
+    var first = devicesPaged ? Math.min(watchWindowStart, deviceCount) : 0;
+    var end = devicesPaged ? Math.min(watchWindowStart + watchWindowSize, deviceCount) : deviceCount;
+    var restURLs = [], changed = false, unmodified = 0, k;
+    for (k = first; k < end; k += 1) {
+        restURLs.push(devices[k].device_rest_url);
+    }
+    // The rows on the watch's screen are polled first, and sent as soon as they're confirmed; the rest of the
+    // stale rows the poll confirms go together in the bulk lane once it's done
+    var visible = visibleRows(VISIBLE_LIST_DEVICES).filter(function(row) {
+        return (row >= first) && (row < end);
+    }).map(function(row) {
+        return row - first;
+    });
+    var confirmed = [];
+    
+    // Take the polled state of a device; returns "changed" if it did, "confirmed" if it didn't but the watch
+    // has it as stale, otherwise null
+    var update = function(k, status, responseText) {
+        var i = first + k;
+        // Skip devices that were resynced or are being changed from the watch since the poll started
+        if (devicesSyncing || !devices[i] || (devices[i].device_rest_url !== restURLs[k]) ||
+            togglesInFlight[i] || dimsInFlight.hasOwnProperty(i) || commandQueue.hasOwnProperty(restURLs[k])) {
+            return null;
+        }
+        var wasConfirmed = deviceConfirmed(devices[i]);
+        confirmedStates[restURLs[k]] = true;
+        var isOn = (status == 304) ? devices[i].device_on : JSON.parse(responseText).isOn;
+        if (isOn !== devices[i].device_on) {
+            devices[i].device_on = isOn;
+            storeRecordChanged("device", i);
+            changed = true;
+            return "changed";
+        }
+        return wasConfirmed ? null : "confirmed";
     };
-    req.send(null);
+    
+    fetchInOrder(restURLs, fetchConcurrency,
+        function(k, status, responseText, req) {
+            if (status == 304) {
+                unmodified++;
+            }
+            else if (status != 200) {
+                console.log("Poll of device " + restURLs[k] + " returned error code " + status.toString());
+                return;
+            }
+            else {
+                deviceValidators[restURLs[k]] = {
+                    etag: req.getResponseHeader("ETag"),
+                    lastModified: req.getResponseHeader("Last-Modified")
+                };
+            }
+            var result = update(k, status, responseText);
+            if (result === "changed") {
+                sendDeviceInfo(first + k, devices[first + k]);
+            }
+            else if (result === "confirmed") {
+                confirmed.push(first + k);
+            }
+        },
+        function() {
+            pollInProgress = false;
+            console.log("Polled " + restURLs.length + " devices, " + unmodified + " unmodified, " + confirmed.length + " confirmed" + (changed ? ", some changed" : ""));
+            sendRecordBatches({}, "device", confirmed.filter(deviceInWatchWindow),
+                              function(i, deviceNumber) {
+                                  return encodeDevice(deviceNumber, devices[deviceNumber]);
+                              });
+            if (changed) {
+                pollInterval = POLL_INTERVAL_MIN_MS;
+            } else {
+                pollInterval = Math.min(pollInterval * 2, POLL_INTERVAL_MAX_MS);
+            }
+            schedulePoll();
+        },
+        function(k, req) {
+            var validators = deviceValidators[restURLs[k]];
+            if (validators && validators.etag) {
+                req.setRequestHeader("If-None-Match", validators.etag);
+            }
+            if (validators && validators.lastModified) {
+                req.setRequestHeader("If-Modified-Since", validators.lastModified);
+            }
+        },
+        visible,
+        function(k, status, responseText) {
+            if (((status == 200) || (status == 304)) && update(k, status, responseText)) {
+                sendDeviceInfo(first + k, devices[first + k]);
+            }
+        });
+}
+
+// The watch tells us when its devices list appears or goes away; state is fetched straight away when it
+// appears, so what the user sees is never more than a round trip out of date
+function setDevicesVisible(visible) {
+    devicesVisible = visible;
+    if (visible) {
+        pollInterval = POLL_INTERVAL_MIN_MS;
+        if (pollTimer !== null) {
+            stopPolling();
+            pollDevices();
+        }
+    }
 }
 
-function toggleDeviceOnOff(deviceNumber) {
-    var req = new XMLHttpRequest();
-    // TODO: Support Digest Authentication
-    req.open('GET', prefixForGet + devices[deviceNumber].device_rest_url + "?toggle=1&_method=put", true);  // `true` makes the request asynchronous
-    req.onload = function(e) {
+// Tell the watch a toggle, dim or execute didn't go through, so it can put the row back to how it was
+function sendCommandFailed(numberKey, number, onSent) {
+    var message = {"command_failed": 1};
+    message[numberKey] = number;
+    send(message, {priority: PRIORITY_INTERACTIVE, onSent: onSent});
+}
+
+// Switch the device to the state the watch is already showing (on is 0 or 1), or just toggle it if the watch
+// didn't know its state (on is undefined); setting rather than toggling means a repeated request can't undo itself.
+// trace is null unless the watch asked for the toggle to be traced.
+function toggleDeviceOnOff(deviceNumber, on, trace) {
+    var device = deviceAt(deviceNumber);
+    if (!device) {
+        console.log("Toggle for unknown device " + deviceNumber);
+        sendCommandFailed("device_number", deviceNumber);
+        return;
+    }
+    var query = (on === undefined)? "?toggle=1&_method=put" : "?isOn=" + (on ? 1 : 0) + "&_method=put";
+    if (commandQueueWanted(device.device_rest_url)) {
+        commandQueueAdd("device", deviceNumber, device.device_rest_url, query);
+        return;
+    }
+    togglesInFlight[deviceNumber] = true;
+    traceRequestStart(trace);
+    indigoGet(device.device_rest_url + query, function(req) {
         if (req.readyState == 4) {
+            delete togglesInFlight[deviceNumber];
             // 200 - HTTP OK
             if(req.status == 200) {
                 var deviceInfo = JSON.parse(req.responseText);
-                devices[deviceNumber].device_on = deviceInfo.isOn;
-                sendDeviceInfo(deviceNumber, devices[deviceNumber]);
-                localStorage.setItem("devices", JSON.stringify(devices));
+                deviceCommandDone(deviceNumber, device, deviceInfo.isOn, traceRequestEnd(trace));
             } else {
-                // TODO: inform pebble that toggle failed
                 console.log("Request returned error code " + req.status.toString());
+                sendCommandFailed("device_number", deviceNumber, traceRequestEnd(trace));
             }
         }
-    };
-    req.send(null);
+    }, function(req) {
+        delete togglesInFlight[deviceNumber];
+        console.log("Toggle request for device " + deviceNumber + " failed, queueing it");
+        commandQueueAdd("device", deviceNumber, device.device_rest_url, query, traceRequestEnd(trace));
+    }, null, true);
 }
 
 function sendActionCount(actionCount) {
@@ -236,24 +1600,47 @@ function sendActionCount(actionCount) {
          "action_count": actionCount});
 }
 
-function sendActionInfo(actionNumber, actionInfo) {
+// Send an update for a single action, ahead of any bulk sync and replacing any older update still queued for it;
+// onSent (optional) is called once the watch has it
+function sendActionInfo(actionNumber, actionInfo, onSent) {
+    var fields = encodeAction(actionNumber, actionInfo);
     send({"action": 1,
-        "action_number": actionNumber,
-        "action_name": actionInfo.action_name});
+        "action_records": packRecords([fields]),
+        "action_snapshot_version": actionsSnapshotVersion()},
+        {priority: PRIORITY_INTERACTIVE, key: recordKey("action", actionNumber), fields: fields, onSent: onSent});
 }
 
-function getActions() {
-    var req = new XMLHttpRequest();
+// Send the action count along with every action not already held by the watch, batched into as few
+// messages as possible and closed by the snapshot version
+function sendActions(watchActions) {
+    var actionNumbers = [];
+    for (var i = 0, j = actions.length; i < j; i += 1) {
+        if (!watchActions[i] || (watchActions[i].action_name !== actions[i].action_name)) {
+            actionNumbers.push(i);
+        }
+    }
+    sendVisibleFirst({"action_count_complete": 1, "action_count": actionCount}, "action", VISIBLE_LIST_ACTIONS, actionNumbers,
+                     function(i, actionNumber) {
+                         return encodeAction(actionNumber, actions[actionNumber]);
+                     },
+                     {"action_snapshot_version": actionsSnapshotVersion()});
+}
+
+var actionsSyncing = false;
+
+// Get the actions from the Indigo Server. If watchSnapshotVersion matches the actions we last sent, the
+// watch already holds them, so only actions that were inserted, changed or removed since are sent.
+function getActions(watchSnapshotVersion) {
+    actionsSyncing = true;
+    syncHeartbeatStart();
+    
     // Get the list of all actions known to the Indigo Server
-    req.open('GET', prefixForGet + "/actions.json", true);  // `true` makes the request asynchronous
-    // Indigo uses Digest authentication, so this won't work:
-    //    req.setRequestHeader("Authorization", "Basic " + btoa(username + ":" + password))
-    // Instead, see http://stackoverflow.com/questions/10937890/javascript-digest-manually-authentication?rq=1
-    // TODO: Support Digest Authentication
-    req.onload = function(e) {
+    indigoGet("/actions.json", function(req) {
+        actionsSyncing = false;
         if(req.status == 200) {
             var response = JSON.parse(req.responseText);
             if (response.length > 0) {
+                var watchActions = (watchSnapshotVersion === actionsSnapshotVersion())? actions : [];
                 actionCount = 0;
                 actions = [];
                 
@@ -267,86 +1654,397 @@ function getActions() {
                     };
                     actionCount++;
                 }
-                localStorage.setItem("actionCount", actionCount);
-                localStorage.setItem("actions", JSON.stringify(actions));
-                
-                // We've got the total count of actions, so send it out
-                sendActionCount(actionCount);
+                storeRecordChanged("action");
                 
-                // Now send out the information for each action
-                for (i = 0, j = actions.length; i < j; i += 1) {
-                    sendActionInfo(i, actions[i]);
-                }
+                // We've got the total count of actions, so send it out along with each changed action
+                sendActions(watchActions);
             }
             else {
                 sendActionCount(0);
             }
         } else {
             console.log("Request returned error code " + req.status.toString());
-            sendActionCount(0);
+            sendCouldNotConnect(COULD_NOT_CONNECT_ACTIONS);
         }
-    };
-    req.send(null);
+    }, function(req) {
+        console.log("Actions request failed");
+        actionsSyncing = false;
+        sendCouldNotConnect(COULD_NOT_CONNECT_ACTIONS);
+    });
 }
 
-function executeAction(actionNumber) {
-    var req = new XMLHttpRequest();
-    // TODO: Support Digest Authentication
-    req.open('GET', prefixForGet + actions[actionNumber].action_rest_url + "?_method=execute", true);  // `true` makes the request asynchronous
-    req.onload = function(e) {
+// trace is null unless the watch asked for the execute to be traced
+function executeAction(actionNumber, trace) {
+    var action = actions[actionNumber];
+    if (!action) {
+        console.log("Execute for unknown action " + actionNumber);
+        sendCommandFailed("action_number", actionNumber);
+        return;
+    }
+    var query = "?_method=execute";
+    if (commandQueueWanted(action.action_rest_url)) {
+        commandQueueAdd("action", actionNumber, action.action_rest_url, query);
+        return;
+    }
+    traceRequestStart(trace);
+    indigoGet(action.action_rest_url + query, function(req) {
         if (req.readyState == 4) {
             // 200 - HTTP OK
             if (req.status == 200) {
-                sendActionInfo(actionNumber, actions[actionNumber]);
+                // The actions may have been synced since, moving this one
+                var current = recordNumberOf("action", action.action_rest_url, actionNumber);
+                if (current >= 0) {
+                    sendActionInfo(current, actions[current], traceRequestEnd(trace));
+                }
             } else {
-                // TODO: inform pebble that action failed
                 console.log("Request returned error code " + req.status.toString());
+                sendCommandFailed("action_number", actionNumber, traceRequestEnd(trace));
             }
         }
-    };
-    req.send(null);
+    }, function(req) {
+        console.log("Execute request for action " + actionNumber + " failed, queueing it");
+        commandQueueAdd("action", actionNumber, action.action_rest_url, query, traceRequestEnd(trace));
+    }, null, true);
+}
+
+// Switch each of the given devices (every device if deviceNumbers is null) on or off, with the requests to the
+// Indigo Server in parallel, then send the watch all of their state in one go along with how many couldn't be
+// switched and how many were queued because the server couldn't be reached (those rows are sent once they
+// switch). trace is null unless the watch asked for the command to be traced.
+function groupOnOff(on, deviceNumbers, trace) {
+    var i, j;
+    if (!deviceNumbers) {
+        deviceNumbers = [];
+        for (i = 0; deviceAt(i); i += 1) {
+            deviceNumbers.push(i);
+        }
+    }
+    deviceNumbers = deviceNumbers.filter(function(deviceNumber) {
+        return deviceAt(deviceNumber);
+    });
+    
+    var query = "?isOn=" + (on ? 1 : 0) + "&_method=put";
+    var queued = deviceNumbers.filter(function(deviceNumber) {
+        var restURL = deviceAt(deviceNumber).device_rest_url;
+        if (commandQueueWanted(restURL)) {
+            commandQueueAdd("device", deviceNumber, restURL, query, null, true);
+            return true;
+        }
+        return false;
+    });
+    deviceNumbers = deviceNumbers.filter(function(deviceNumber) {
+        return queued.indexOf(deviceNumber) < 0;
+    });
+    
+    var groupDevices = [], restURLs = [], failed = 0, queuedFirst = queued.length;
+    for (i = 0, j = deviceNumbers.length; i < j; i += 1) {
+        groupDevices[i] = deviceAt(deviceNumbers[i]);
+        restURLs[i] = groupDevices[i].device_rest_url;
+        togglesInFlight[deviceNumbers[i]] = true;
+    }
+    
+    traceRequestStart(trace);
+    fetchInOrder(restURLs.map(function(restURL) { return restURL + query; }),
+        GROUP_CONCURRENCY,
+        function(i, status, responseText) {
+            var deviceNumber = deviceNumbers[i];
+            delete togglesInFlight[deviceNumber];
+            if (status === 0) {
+                commandQueueAdd("device", deviceNumber, restURLs[i], query, null, true);
+                queued.push(deviceNumber);
+            }
+            else if (status != 200) {
+                console.log("Group request for device " + deviceNumber + " returned error code " + status.toString());
+                failed++;
+            }
+            else {
+                var isOn = JSON.parse(responseText).isOn, current = recordNumberOf("device", restURLs[i], deviceNumber);
+                groupDevices[i].device_on = isOn;
+                confirmedStates[restURLs[i]] = true;
+                if (current >= 0) {
+                    devices[current].device_on = isOn;
+                    storeRecordChanged("device", current);
+                }
+            }
+        },
+        function() {
+            console.log("Switched " + (deviceNumbers.length - failed - (queued.length - queuedFirst)) + " of " + (deviceNumbers.length + queuedFirst) +
+                        " devices " + (on ? "on" : "off") + ", " + queued.length + " queued");
+            var trailer = {"group_failed": failed};
+            if (queued.length > 0) {
+                trailer.group_queued = queued.length;
+            }
+            if (!devicesPaged) {
+                trailer.device_snapshot_version = devicesSnapshotVersion();
+            }
+            sendRecordBatches({}, "device", deviceNumbers.filter(function(deviceNumber) {
+                                  return deviceAt(deviceNumber) && deviceInWatchWindow(deviceNumber) && (queued.indexOf(deviceNumber) < 0);
+                              }),
+                              function(i, deviceNumber) {
+                                  return encodeDevice(deviceNumber, deviceAt(deviceNumber));
+                              },
+                              trailer, PRIORITY_INTERACTIVE, traceRequestEnd(trace));
+        }, null, null, null, true);
 }
 
-function dimDevice(deviceNumber, dimLevel) {
-    var req = new XMLHttpRequest();
-    // TODO: Support Digest Authentication
-    req.open('GET', prefixForGet + devices[deviceNumber].device_rest_url + "?brightness=" + dimLevel + "&_method=put", true);  // `true` makes the request asynchronous
-    req.onload = function(e) {
+// Device numbers packed by the watch as little endian 16 bit values
+function unpackDeviceNumbers(bytes) {
+    var deviceNumbers = [];
+    for (var i = 0; i + 1 < bytes.length; i += 2) {
+        deviceNumbers.push(bytes[i] | (bytes[i + 1] << 8));
+    }
+    return deviceNumbers;
+}
+
+// Dim requests in flight, by device number, each with the latest level asked for while it was in flight
+// (null if none); live dimming from the watch only ever has one request per device out to the Indigo Server,
+// and the level asked for last is always applied. Only dims sent straight away are traced.
+var dimsInFlight = {};
+
+// trace is null unless the watch asked for the dim to be traced
+function dimDevice(deviceNumber, dimLevel, trace) {
+    if (dimsInFlight.hasOwnProperty(deviceNumber)) {
+        dimsInFlight[deviceNumber] = dimLevel;
+        return;
+    }
+    var device = deviceAt(deviceNumber);
+    if (!device) {
+        console.log("Dim for unknown device " + deviceNumber);
+        sendCommandFailed("device_number", deviceNumber);
+        return;
+    }
+    var query = "?brightness=" + dimLevel + "&_method=put";
+    if (commandQueueWanted(device.device_rest_url)) {
+        commandQueueAdd("device", deviceNumber, device.device_rest_url, query);
+        return;
+    }
+    dimsInFlight[deviceNumber] = null;
+    
+    // Returns true if a newer level arrived while this request was in flight, which is then sent in its place
+    function dimSuperseded() {
+        var latestLevel = dimsInFlight[deviceNumber];
+        delete dimsInFlight[deviceNumber];
+        if (latestLevel !== null) {
+            dimDevice(deviceNumber, latestLevel);
+            return true;
+        }
+        return false;
+    }
+    
+    traceRequestStart(trace);
+    indigoGet(device.device_rest_url + query, function(req) {
         if (req.readyState == 4) {
+            if (dimSuperseded()) {
+                return;
+            }
             // 200 - HTTP OK
             if(req.status == 200) {
                 var deviceInfo = JSON.parse(req.responseText);
-                devices[deviceNumber].device_on = deviceInfo.isOn;
-                sendDeviceInfo(deviceNumber, devices[deviceNumber]);
-                localStorage.setItem("devices", JSON.stringify(devices));
+                deviceCommandDone(deviceNumber, device, deviceInfo.isOn, traceRequestEnd(trace));
             } else {
-                // TODO: inform pebble that dim failed
                 console.log("Request returned error code " + req.status.toString());
+                sendCommandFailed("device_number", deviceNumber, traceRequestEnd(trace));
             }
         }
-    };
-    req.send(null);
+    }, function(req) {
+        if (!dimSuperseded()) {
+            console.log("Dim request for device " + deviceNumber + " failed, queueing it");
+            commandQueueAdd("device", deviceNumber, device.device_rest_url, query, traceRequestEnd(trace));
+        }
+    }, null, true);
+}
+
+var commandRetryTimer = null, commandRetryInterval = COMMAND_RETRY_MIN_MS, commandReplayInProgress = false;
+
+// Whether a command for the given REST URL should go to the queue rather than straight to the Indigo Server:
+// while the server can't be reached, and behind any command for the same device or action already queued
+function commandQueueWanted(restURL) {
+    return !indigoReachable || commandQueue.hasOwnProperty(restURL);
+}
+
+// Queue a command for the given device or action ("device" or "action") in the given row, with its REST URL
+// and the query to send it with, replacing any command already queued for it, and tell the watch (unless
+// quiet) so it shows the row as queued; onSent (optional) is called once the watch has been told
+function commandQueueAdd(kind, number, restURL, query, onSent, quiet) {
+    commandQueue[restURL] = {kind: kind, number: number, query: query, queuedAt: Date.now()};
+    storeDocumentChanged("commandQueue");
+    if (!quiet) {
+        var message = {"command_queued": 1};
+        message[kind + "_number"] = number;
+        send(message, {priority: PRIORITY_INTERACTIVE, onSent: onSent});
+    }
+    commandQueueRetryLater();
+}
+
+function commandQueueRetryLater() {
+    if ((commandRetryTimer === null) && !commandReplayInProgress) {
+        commandRetryTimer = setTimeout(commandQueueReplay, commandRetryInterval);
+    }
+}
+
+function commandQueueClear() {
+    commandQueue = {};
+    storeDocumentChanged("commandQueue");
+    if (commandRetryTimer !== null) {
+        clearTimeout(commandRetryTimer);
+        commandRetryTimer = null;
+    }
+    commandRetryInterval = COMMAND_RETRY_MIN_MS;
+    indigoReachable = true;
+}
+
+// Any answer from the Indigo Server means the queue can go
+function commandQueueServerAnswered() {
+    indigoReachable = true;
+    if (!commandReplayInProgress && (Object.keys(commandQueue).length > 0)) {
+        if (commandRetryTimer !== null) {
+            clearTimeout(commandRetryTimer);
+        }
+        commandRetryTimer = setTimeout(commandQueueReplay, 0);
+    }
+}
+
+// Send every queued command to the Indigo Server at once, giving up on those queued too long ago. Each that
+// gets an answer leaves the queue and its row is sent to the watch (or the watch told it failed); the rest stay
+// queued and are tried again later.
+function commandQueueReplay() {
+    commandRetryTimer = null;
+    var replayed = {}, restURLs = [], now = Date.now();
+    Object.keys(commandQueue).forEach(function(restURL) {
+        var entry = commandQueue[restURL], number = recordNumberOf(entry.kind, restURL, entry.number);
+        if ((number < 0) && ((entry.kind === "device") ? devicesSyncing : actionsSyncing)) {
+            // The sync may yet bring it back, and replays the queue once it's done
+            return;
+        }
+        if ((number < 0) || (now - entry.queuedAt > QUEUED_COMMAND_EXPIRY_MS)) {
+            console.log("Gave up on queued command for " + restURL);
+            delete commandQueue[restURL];
+            storeDocumentChanged("commandQueue");
+            if (number >= 0) {
+                sendCommandFailed(entry.kind + "_number", number);
+            }
+            return;
+        }
+        replayed[restURL] = entry;
+        restURLs.push(restURL);
+    });
+    if (restURLs.length === 0) {
+        commandRetryInterval = COMMAND_RETRY_MIN_MS;
+        return;
+    }
+    
+    commandReplayInProgress = true;
+    var sent = 0;
+    fetchInOrder(restURLs.map(function(restURL) { return restURL + replayed[restURL].query; }),
+        GROUP_CONCURRENCY,
+        function(i, status, responseText) {
+            var restURL = restURLs[i], entry = replayed[restURL];
+            if (status === 0) {
+                return;
+            }
+            // A command queued for the same device or action while this one was on its way is still to go
+            if (commandQueue[restURL] === entry) {
+                delete commandQueue[restURL];
+                storeDocumentChanged("commandQueue");
+            }
+            sent++;
+            var number = recordNumberOf(entry.kind, restURL, entry.number);
+            if (number < 0) {
+                return;
+            }
+            if (status != 200) {
+                console.log("Queued command for " + restURL + " returned error code " + status.toString());
+                sendCommandFailed(entry.kind + "_number", number);
+            }
+            else if (entry.kind === "device") {
+                devices[number].device_on = JSON.parse(responseText).isOn;
+                confirmedStates[restURL] = true;
+                sendDeviceInfo(number, devices[number]);
+                storeRecordChanged("device", number);
+            }
+            else {
+                sendActionInfo(number, actions[number]);
+            }
+        },
+        function() {
+            commandReplayInProgress = false;
+            console.log("Replayed " + sent + " of " + restURLs.length + " queued commands");
+            if (Object.keys(commandQueue).length === 0) {
+                commandRetryInterval = COMMAND_RETRY_MIN_MS;
+            }
+            else if (sent === restURLs.length) {
+                // Only commands queued while the replay was on its way are left
+                commandRetryTimer = setTimeout(commandQueueReplay, 0);
+            }
+            else {
+                commandRetryInterval = Math.min(commandRetryInterval * 2, COMMAND_RETRY_MAX_MS);
+                commandQueueRetryLater();
+            }
+        }, null, null, null, true);
 }
 
 // Set callback for appmessage events
 Pebble.addEventListener("appmessage", function(e) {
     console.log("appmessage received!!!!");
+    if (e.payload.get_devices_and_actions) {
+        storeLoadRequestDocuments();
+    }
+    else {
+        storeLoad();
+    }
+    var trace = e.payload.trace ? {receivedAt: Date.now()} : null;
     if (e.payload.get_devices_and_actions) {
         console.log("get_devices_and_actions flag in payload");
-        getDevices();
-        getActions();
+        if (e.payload.inbox_size) {
+            watchInboxSize = e.payload.inbox_size;
+        }
+        if (e.payload.max_devices && e.payload.device_window_size) {
+            watchMaxDevices = e.payload.max_devices;
+            watchWindowSize = e.payload.device_window_size;
+        }
+        watchVisible = {list: e.payload.visible_list || 0, start: e.payload.visible_row || 0, count: e.payload.visible_row_count || 0};
+        // Whatever an earlier sync still has on its way is superseded by this one
+        startGeneration();
+        // The list on screen gets its request in first
+        if (watchVisible.list === VISIBLE_LIST_ACTIONS) {
+            getActions(e.payload.action_snapshot_version);
+            getDevices(e.payload.device_snapshot_version);
+        }
+        else {
+            getDevices(e.payload.device_snapshot_version);
+            getActions(e.payload.action_snapshot_version);
+        }
+        // Both lists are on their way, so read the stored ones to compare them with while we wait
+        storeLoad();
     }
     if (e.payload.device_toggle_on_off) {
         console.log("device_toggle_on_off flag in payload");
-        toggleDeviceOnOff(e.payload.device_number);
+        toggleDeviceOnOff(e.payload.device_number, e.payload.device_on, trace);
     }
     if (e.payload.action_execute) {
         console.log("action_execute flag in payload");
-        executeAction(e.payload.action_number);
+        executeAction(e.payload.action_number, trace);
     }
     if (e.payload.device_dim) {
         console.log("device_dim flag in payload");
-        dimDevice(e.payload.device_number, e.payload.device_dim_level);
+        dimDevice(e.payload.device_number, e.payload.device_dim_level, trace);
+    }
+    if (e.payload.group_on_off !== undefined) {
+        console.log("group_on_off in payload");
+        groupOnOff(e.payload.group_on_off, e.payload.group_devices ? unpackDeviceNumbers(e.payload.group_devices) : null, trace);
+    }
+    if (e.payload.diagnostics) {
+        console.log("diagnostics flag in payload");
+        dumpTraces();
+        send({"diagnostics": traceSummary()}, {priority: PRIORITY_INTERACTIVE});
+    }
+    if (e.payload.device_window_start !== undefined) {
+        console.log("device_window_start in payload");
+        moveWatchWindow(e.payload.device_window_start);
+    }
+    if (e.payload.devices_visible !== undefined) {
+        console.log("devices_visible in payload");
+        setDevicesVisible(e.payload.devices_visible == 1);
     }
 });
 
@@ -390,23 +2088,35 @@ p,a {color: rgb(200,200,200)}\
 <label for="server-port">Server Port Number:</label>\
 <br>\
 <input type="text" size="15" name="server-port" id="server-port" required></input>\
+<br>\
+<label for="username">Username (if authentication is on):</label>\
+<br>\
+<input type="text" size="15" name="username" id="username" autocapitalize="off" autocorrect="off"></input>\
+<br>\
+<label for="password">Password:</label>\
+<br>\
+<input type="password" size="15" name="password" id="password"></input>\
 <br><br>\
 <input type="submit" value="Save">\
 <br>\
 </form>\
 <p>\
-Authenticated connections and Prism Reflector are not yet supported.<br>\
+Prism Reflector is not yet supported.<br>\
 </p>\
 <script>\
 var config = JSON.parse(\'__CONFIG__\');\
 document.getElementById("server-address").value = config.serverAddress;\
 document.getElementById("server-port").value = config.serverPort;\
+document.getElementById("username").value = config.username;\
+document.getElementById("password").value = config.password;\
 function onSubmit(e) {\
 var result = {\
 serverAddress: document.getElementById("server-address").value,\
 serverPort: document.getElementById("server-port").value,\
+username: document.getElementById("username").value,\
+password: document.getElementById("password").value,\
 };\
-window.location.href = "pebblejs://close#" + JSON.stringify(result);\
+window.location.href = "pebblejs://close#" + encodeURIComponent(JSON.stringify(result));\
 return false;\
 }\
 </script>\
@@ -28,17 +28,30 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "pebble.h"
 
 #define TOP_MENU_NUM_SECTIONS 1
-#define TOP_MENU_FIRST_SECTION_NUM_MENU_ITEMS 2
+#define TOP_MENU_FIRST_SECTION_NUM_MENU_ITEMS 4
 #define TOP_MENU_NUM_ICONS 2
 
 #define DEVICES_MENU_NUM_SECTIONS 1
-#define MAX_NUMBER_OF_DEVICES 50
+#define MAX_NUMBER_OF_DEVICES 500
 #define MAX_DEVICE_NAME_LENGTH 96
+// Lists longer than MAX_NUMBER_OF_DEVICES are paged: only a window of DEVICE_WINDOW_PAGES pages around the
+// selected row is held, and the phone sends the rows of each page as it scrolls into the window
+#define DEVICE_PAGE_SIZE 16
+#define DEVICE_WINDOW_PAGES 4
+#define DEVICE_WINDOW_SIZE (DEVICE_PAGE_SIZE * DEVICE_WINDOW_PAGES)
+#define MAX_NUMBER_OF_PAGED_DEVICES 0xFFF0
 
 #define ACTIONS_MENU_NUM_SECTIONS 1
-#define MAX_NUMBER_OF_ACTIONS 50
+#define MAX_NUMBER_OF_ACTIONS 500
 #define MAX_ACTION_NAME_LENGTH 96
 
+// Device and action names share one pool, sized from the reported counts and grown as
+// needed up to MAX_NAME_POOL_SIZE; records refer to their name by offset into the pool
+#define NAME_POOL_BYTES_PER_RECORD 18
+#define MAX_NAME_POOL_SIZE 12288
+#define NAME_LOADING 0xFFFF
+#define NAME_UNAVAILABLE 0xFFFE
+
 #define MAX_DIM 100
 #define MIN_DIM 0
 #define DEFAULT_DIM 50
@@ -52,6 +65,98 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define STATUS_LOADING 14
 #define STATUS_COULD_NOT_CONNECT 15
 #define STATUS_LOADED 16
+#define STATUS_FAILED 17
+#define STATUS_FAILED_OFF 18
+#define STATUS_FAILED_ON 19
+#define STATUS_QUEUED 20
+#define STATUS_QUEUED_OFF 21
+#define STATUS_QUEUED_ON 22
+#define STATUS_STALE_OFF 23
+#define STATUS_STALE_ON 24
+
+// Which lists a could_not_connect message from the phone is about
+#define COULD_NOT_CONNECT_DEVICES 1
+#define COULD_NOT_CONNECT_ACTIONS 2
+
+// A request for the lists says which list is on screen (or, from the main menu, selected to be opened next)
+// and its rows that are, so the phone can fetch and send those first; SCREEN_ROWS menu rows fit on screen
+#define VISIBLE_LIST_DEVICES 1
+#define VISIBLE_LIST_ACTIONS 2
+#define SCREEN_ROWS 4
+
+// The phone says when its script is ready and we ask for the lists straight away. Until they arrive the phone
+// sends a heartbeat every couple of seconds, so we only give up (in case it isn't running or can't reach us at
+// all) once it has been quiet for LOADING_TIMEOUT_FACTOR times the longest it went quiet during the last
+// LOADING_GAP_SAMPLES loads, within LOADING_TIMEOUT_MIN_MS and LOADING_TIMEOUT_MAX_MS, or LOADING_TIMEOUT_MS
+// until we have measured any. When it can't reach the Indigo Server it says so sooner.
+#define LOADING_TIMEOUT_MS 10000
+#define LOADING_TIMEOUT_MIN_MS 5000
+#define LOADING_TIMEOUT_MAX_MS 30000
+#define LOADING_TIMEOUT_FACTOR 2
+#define LOADING_GAP_SAMPLES 4
+#define PERSIST_KEY_LOADING_GAPS 1
+
+// The phone packs device and action records into a byte array: each is the zigzag varint difference
+// between its number and the one following the previous record's, a byte holding the name's length
+// shifted left by one above the on bit (and below the stale bit, set when the phone only knows the state
+// from an earlier run), then the name's UTF-8 bytes, at most MAX_RECORD_NAME_LENGTH
+#define MAX_RECORD_NAME_LENGTH 40
+#define RECORD_ON_BIT 0x01
+#define RECORD_STALE_BIT 0x80
+#define RECORD_NAME_LENGTH_MASK 0x7F
+
+// The last known devices and actions are persisted as a header plus a run of chunks, each at most
+// PERSIST_DATA_MAX_LENGTH bytes, holding variable length records that may straddle chunk boundaries
+#define SNAPSHOT_VERSION 3
+#define PERSIST_KEY_SNAPSHOT_HEADER 100
+#define PERSIST_KEY_SNAPSHOT_FIRST_CHUNK 101
+#define MAX_SNAPSHOT_CHUNKS 14
+#define MAX_SNAPSHOT_NAME_LENGTH 40
+
+// Commands for the phone wait in a small queue until the outbox is free; a send that fails is retried
+// after a delay that doubles each time, and given up on after COMMAND_MAX_ATTEMPTS
+#define COMMAND_QUEUE_CAPACITY 8
+#define COMMAND_MAX_ATTEMPTS 5
+#define COMMAND_RETRY_DELAY_MS 100
+
+// Toggles and dims show their result straight away; if the phone doesn't confirm within COMMAND_TIMEOUT_MS
+// (or reports a failure) the row goes back to its previous state, marked as failed
+#define MAX_PENDING_COMMANDS 8
+#define COMMAND_TIMEOUT_MS 10000
+
+// Switching every device on or off is one command, which the phone carries out with its requests to the
+// Indigo Server in parallel; it answers with the devices' new state and how many couldn't be switched
+#define GROUP_TIMEOUT_MS 20000
+
+// Toggles, dims and executes are timed once the diagnostics window (a long press on the main menu) has been
+// opened: on the watch from the click until the phone has the command, until the phone confirms it and until
+// the confirmed row is drawn, and on the phone for each of its stages. Percentiles are taken over the most
+// recent TRACE_SAMPLES of each.
+#define TRACE_SAMPLES 16
+#define MAX_PHONE_DIAGNOSTICS_LENGTH 128
+
+// Inbound messages only note which menus need redrawing; they're redrawn at most once per REDRAW_INTERVAL_MS,
+// so a sync streaming in dozens of messages a second doesn't repaint the menu for every one of them
+#define REDRAW_INTERVAL_MS 50
+
+// Buffer sizes for app_message_open(), 0 taking the largest the watch allows. The phone packs as many records
+// into each message as the inbox holds, so a smaller inbox saves heap at the cost of more messages per sync;
+// the largest message we send (the request for the lists) is under 100 bytes.
+#define APP_MESSAGE_INBOX_SIZE 0
+#define APP_MESSAGE_OUTBOX_SIZE 128
+
+// Set to 1 to log per-handler latency, message counts and peak heap use, for measuring changes to the
+// protocol and data layout on the emulator or a watch (see the "Profile" lines in pebble logs). Heap use is
+// also logged as each window loads and unloads and each list finishes syncing, and checked against a budget
+// of HEAP_BUDGET_BASE_BYTES (windows, layers and bitmaps) plus the message buffers plus
+// HEAP_BUDGET_BYTES_PER_RECORD for each device and action held; going over it logs a warning, so a change
+// that grows memory use shows up as soon as it's profiled with a list of the size that matters. The host
+// build in test/ turns it on to report the same counts from replayed traces.
+#ifndef PROFILING
+#define PROFILING 0
+#endif
+#define HEAP_BUDGET_BASE_BYTES 6144
+#define HEAP_BUDGET_BYTES_PER_RECORD 24
 
 // Handy for using snprintf to display integers
 //#define TEMP_STRING_LENGTH 15
@@ -64,8 +169,22 @@ static GBitmap *action_menu_item_icon;
 
 static Window *devices_window;
 static MenuLayer *devices_menu_layer;
-static uint8_t deviceCount = 0;
+static uint16_t deviceCount = 0;
 static uint8_t gotDeviceCount = STATUS_LOADING;
+static bool devicesPartial = false; // Some devices' details couldn't be fetched, so they're missing from the list
+static AppTimer *loading_timeout_timer = NULL;
+static bool phoneReady = false; // The phone's script is running, so it can take our requests
+static uint32_t loadingHeardAt = 0; // When we last asked for the lists or heard from the phone while they loaded
+static uint32_t loadingLongestGap = 0;
+static uint16_t loadingGaps[LOADING_GAP_SAMPLES]; // Longest gap of each recent load, most recent first
+
+// The last group command: whether it switched devices on, STATUS_TOGGLING while it's out, then STATUS_LOADED
+// with how many devices couldn't be switched, or STATUS_FAILED if the phone never answered
+static bool groupOn = false;
+static uint8_t groupStatus = STATUS_NONE;
+static uint16_t groupFailedCount = 0;
+static uint16_t groupQueuedCount = 0;
+static AppTimer *group_timeout_timer = NULL;
 
 static Window *dim_window;
 static ActionBarLayer *dim_action_bar_layer;
@@ -73,7 +192,7 @@ static TextLayer *dim_header_text_layer;
 static TextLayer *dim_body_text_layer;
 static TextLayer *dim_label_text_layer;
 static uint8_t dimLevel = DEFAULT_DIM;
-static uint8_t selectedDeviceNumber = 0;
+static uint16_t selectedDeviceNumber = 0;
 static char selectedDeviceName[MAX_DEVICE_NAME_LENGTH];
 static GBitmap *action_icon_plus;
 static GBitmap *action_icon_select;
@@ -81,16 +200,26 @@ static GBitmap *action_icon_minus;
 
 static Window *actions_window;
 static MenuLayer *actions_menu_layer;
-static uint8_t actionCount = 0;
+static uint16_t actionCount = 0;
 static uint8_t gotActionCount = STATUS_LOADING;
 
+static Window *diagnostics_window;
+static TextLayer *diagnostics_text_layer;
+
+static uint32_t inboxSize = 0;
+static uint32_t outboxSize = 0;
+
+// Versions of the device and action lists as the phone last sent them in full, 0 if the lists we hold
+// may differ from any version the phone knows of; reported when we ask for data so only changes are sent
+static uint32_t deviceSnapshotVersion = 0;
+static uint32_t actionSnapshotVersion = 0;
+
 enum {
     INDIGO_REMOTE_KEY_GET_DEVICES_AND_ACTIONS = 1,
     INDIGO_REMOTE_KEY_DEVICE_COUNT_COMPLETE = 2,
     INDIGO_REMOTE_KEY_DEVICE_COUNT = 3,
     INDIGO_REMOTE_KEY_DEVICE = 4,
     INDIGO_REMOTE_KEY_DEVICE_NUMBER = 5,
-    INDIGO_REMOTE_KEY_DEVICE_NAME = 6,
     INDIGO_REMOTE_KEY_DEVICE_ON = 7,
     INDIGO_REMOTE_KEY_DEVICE_TOGGLE_ON_OFF = 8,
     INDIGO_REMOTE_KEY_DEVICE_DIM = 9,
@@ -99,222 +228,1712 @@ enum {
     INDIGO_REMOTE_KEY_ACTION_COUNT = 12,
     INDIGO_REMOTE_KEY_ACTION = 13,
     INDIGO_REMOTE_KEY_ACTION_NUMBER = 14,
-    INDIGO_REMOTE_KEY_ACTION_NAME = 15,
     INDIGO_REMOTE_KEY_ACTION_EXECUTE = 16,
-    INDIGO_REMOTE_KEY_LOADING = 17
+    INDIGO_REMOTE_KEY_LOADING = 17,
+    INDIGO_REMOTE_KEY_INBOX_SIZE = 18,
+    INDIGO_REMOTE_KEY_DEVICE_RECORDS = 19,
+    INDIGO_REMOTE_KEY_ACTION_RECORDS = 20,
+    INDIGO_REMOTE_KEY_DEVICE_SNAPSHOT_VERSION = 21,
+    INDIGO_REMOTE_KEY_ACTION_SNAPSHOT_VERSION = 22,
+    INDIGO_REMOTE_KEY_DEVICES_VISIBLE = 23,
+    INDIGO_REMOTE_KEY_MAX_DEVICES = 24,
+    INDIGO_REMOTE_KEY_DEVICE_WINDOW_SIZE = 25,
+    INDIGO_REMOTE_KEY_DEVICE_PAGED = 26,
+    INDIGO_REMOTE_KEY_DEVICE_WINDOW_START = 27,
+    INDIGO_REMOTE_KEY_COMMAND_FAILED = 28,
+    INDIGO_REMOTE_KEY_COULD_NOT_CONNECT = 29,
+    INDIGO_REMOTE_KEY_DEVICES_PARTIAL = 30,
+    INDIGO_REMOTE_KEY_TRACE = 31,
+    INDIGO_REMOTE_KEY_DIAGNOSTICS = 32,
+    INDIGO_REMOTE_KEY_GROUP_ON_OFF = 33,
+    INDIGO_REMOTE_KEY_GROUP_DEVICES = 34,
+    INDIGO_REMOTE_KEY_GROUP_FAILED = 35,
+    INDIGO_REMOTE_KEY_READY = 36,
+    INDIGO_REMOTE_KEY_SYNC_PROGRESS = 37,
+    INDIGO_REMOTE_KEY_VISIBLE_LIST = 38,
+    INDIGO_REMOTE_KEY_VISIBLE_ROW = 39,
+    INDIGO_REMOTE_KEY_VISIBLE_ROW_COUNT = 40,
+    INDIGO_REMOTE_KEY_COMMAND_QUEUED = 41,
+    INDIGO_REMOTE_KEY_GROUP_QUEUED = 42,
+    INDIGO_REMOTE_KEY_DEVICE_COUNT_EXPECTED = 43
 };
 
 typedef struct {
-    char name[MAX_DEVICE_NAME_LENGTH];
+    uint16_t name; // Offset into name_pool, or NAME_LOADING/NAME_UNAVAILABLE
     uint8_t on;
 } DeviceData;
 
-static DeviceData device_data_list[MAX_NUMBER_OF_DEVICES];
+// Holds devices deviceWindowStart onwards; that's always device 0 onwards unless the list is paged
+static DeviceData *device_data_list = NULL;
+static uint16_t deviceCapacity = 0;
+static uint16_t deviceWindowStart = 0;
+static bool devicesPaged = false;
+
+typedef struct {
+    uint16_t name; // Offset into name_pool, or NAME_LOADING/NAME_UNAVAILABLE
+    uint8_t status;
+} ActionData;
+
+static ActionData *action_data_list = NULL;
+static uint16_t actionCapacity = 0;
+
+static char *name_pool = NULL;
+static uint16_t namePoolSize = 0;
+static uint16_t namePoolUsed = 0;
+static uint16_t namePoolGarbage = 0; // Bytes left behind by names that were replaced
+
+typedef enum {
+    COMMAND_GET_DEVICES_AND_ACTIONS,
+    COMMAND_TOGGLE,
+    COMMAND_EXECUTE,
+    COMMAND_DIM,
+    COMMAND_DEVICES_VISIBLE,
+    COMMAND_DEVICE_WINDOW,
+    COMMAND_DIAGNOSTICS,
+    COMMAND_GROUP
+} CommandType;
+
+typedef struct {
+    uint8_t type;
+    uint8_t attempts;
+    uint16_t number; // Device or action number
+    uint16_t value; // Dim level, on/off to switch to (one or every device), whether the devices window is visible, or the first device in the window
+} Command;
+
+// Ring buffer; the command at commandQueueHead is the one in flight, if any
+static Command command_queue[COMMAND_QUEUE_CAPACITY];
+static uint8_t commandQueueHead = 0;
+static uint8_t commandQueueLength = 0;
+static bool commandInFlight = false;
+static AppTimer *command_retry_timer = NULL;
+
+// A command waiting for the phone to confirm it, with what to roll its row back to if it doesn't
+typedef struct {
+    AppTimer *timer; // NULL if not waiting, and the slot is free unless queued
+    bool queued; // Held by the phone until it can reach the Indigo Server, so not timed
+    bool device; // Otherwise an action
+    uint16_t number;
+    uint8_t rollback;
+    uint32_t clickedAt; // For tracing
+} PendingCommand;
+
+static PendingCommand pending_commands[MAX_PENDING_COMMANDS];
+
+
+/******* TRACING *******/
+
+typedef enum {
+    TRACE_SEND, // Click until the phone has the command
+    TRACE_ROUND_TRIP, // Click until the phone confirms it
+    TRACE_RENDER, // Confirmation until the row is drawn
+    TRACE_STAGE_COUNT
+} TraceStage;
+
+static const char *trace_stage_names[TRACE_STAGE_COUNT] = {
+    "Send",
+    "Round trip",
+    "Render"
+};
+
+static bool tracing = false;
+
+// Most recent samples of each stage in ms, as a ring
+static uint16_t traceSamples[TRACE_STAGE_COUNT][TRACE_SAMPLES];
+static uint8_t traceSampleCount[TRACE_STAGE_COUNT];
+static uint8_t traceSampleNext[TRACE_STAGE_COUNT];
+
+// The row whose confirmation is still to be drawn, if any
+static bool traceRenderWaiting = false;
+static bool traceRenderDevice;
+static uint16_t traceRenderNumber;
+static uint32_t traceRenderReceivedAt;
+
+// Percentiles the phone last sent for its own stages, one per line
+static char phoneDiagnostics[MAX_PHONE_DIAGNOSTICS_LENGTH] = "";
+
+static uint32_t now_ms(void) {
+    time_t seconds;
+    uint16_t milliseconds;
+    time_ms(&seconds, &milliseconds);
+    return (uint32_t)seconds * 1000 + milliseconds;
+}
+
+static void trace_record(TraceStage stage, uint32_t sinceMs) {
+    if (!tracing) {
+        return;
+    }
+    uint32_t elapsedMs = now_ms() - sinceMs;
+    traceSamples[stage][traceSampleNext[stage]] = (elapsedMs < UINT16_MAX)? elapsedMs : UINT16_MAX;
+    traceSampleNext[stage] = (traceSampleNext[stage] + 1) % TRACE_SAMPLES;
+    if (traceSampleCount[stage] < TRACE_SAMPLES) {
+        traceSampleCount[stage]++;
+    }
+}
+
+// Nearest-rank percentile of the recent samples of a stage; only called with samples to hand
+static uint16_t trace_percentile(TraceStage stage, uint8_t percent) {
+    uint16_t sorted[TRACE_SAMPLES];
+    uint8_t count = traceSampleCount[stage];
+    for (uint8_t i = 0; i < count; i++) {
+        // Insertion sort, fine for a handful of samples
+        uint16_t sample = traceSamples[stage][i];
+        uint8_t j = i;
+        for (; (j > 0) && (sorted[j - 1] > sample); j--) {
+            sorted[j] = sorted[j - 1];
+        }
+        sorted[j] = sample;
+    }
+    uint8_t rank = (count * percent + 99) / 100;
+    return sorted[(rank > 0)? rank - 1 : 0];
+}
+
+// Start timing how long the given row takes to be drawn after the phone confirmed its command
+static void trace_render_begin(bool device, uint16_t number) {
+    traceRenderWaiting = tracing;
+    traceRenderDevice = device;
+    traceRenderNumber = number;
+    traceRenderReceivedAt = now_ms();
+}
+
+static void trace_render_end(bool device, uint16_t number) {
+    if (traceRenderWaiting && (traceRenderDevice == device) && (traceRenderNumber == number)) {
+        traceRenderWaiting = false;
+        trace_record(TRACE_RENDER, traceRenderReceivedAt);
+    }
+}
+
+static void diagnostics_update_text(void) {
+    static char text[64 + MAX_PHONE_DIAGNOSTICS_LENGTH];
+    int length = snprintf(text, sizeof(text), "Latency p50/p95 ms");
+    for (int i = 0; i < TRACE_STAGE_COUNT; i++) {
+        if (traceSampleCount[i] > 0) {
+            length += snprintf(text + length, sizeof(text) - length, "\n%s %u/%u", trace_stage_names[i],
+                               trace_percentile(i, 50), trace_percentile(i, 95));
+        }
+        else {
+            length += snprintf(text + length, sizeof(text) - length, "\n%s -", trace_stage_names[i]);
+        }
+    }
+    snprintf(text + length, sizeof(text) - length, "\n%s", phoneDiagnostics);
+    text_layer_set_text(diagnostics_text_layer, text);
+}
+
+
+/******* PROFILING *******/
+
+#if PROFILING
+
+enum {
+    PROFILE_IN_RECEIVED,
+    PROFILE_DRAW_ROW,
+    PROFILE_SELECT,
+    PROFILE_HANDLER_COUNT
+};
+
+static const char *profile_handler_names[PROFILE_HANDLER_COUNT] = {
+    "in_received",
+    "draw_row",
+    "select"
+};
+
+typedef struct {
+    uint32_t calls;
+    uint32_t totalMs;
+    uint32_t maxMs;
+} ProfileHandlerStats;
+
+static struct {
+    ProfileHandlerStats handlers[PROFILE_HANDLER_COUNT];
+    uint32_t messagesReceived;
+    uint32_t messagesDropped;
+    uint32_t messagesSent;
+    uint32_t messagesFailed;
+    uint32_t commandsRetried;
+    uint32_t commandsCollapsed;
+    uint32_t commandsAbandoned;
+    uint32_t redraws;
+    uint32_t redrawsCoalesced;
+    uint32_t rowsDrawnAtLastLog;
+    uint32_t heapOverBudget; // Times the heap was found over budget
+    size_t peakHeapUsed;
+} profile_stats;
+
+static void profile_sample_heap(void) {
+    size_t used = heap_bytes_used();
+    if (used > profile_stats.peakHeapUsed) {
+        profile_stats.peakHeapUsed = used;
+    }
+}
+
+// Heap we expect to need with the lists as big as they are now
+static size_t profile_heap_budget(void) {
+    return HEAP_BUDGET_BASE_BYTES + inboxSize + outboxSize +
+           (size_t)(deviceCapacity + actionCapacity) * HEAP_BUDGET_BYTES_PER_RECORD;
+}
+
+static void profile_heap(const char *when) {
+    profile_sample_heap();
+    size_t used = heap_bytes_used(), budget = profile_heap_budget();
+    if (used > budget) {
+        profile_stats.heapOverBudget++;
+    }
+    APP_LOG((used > budget)? APP_LOG_LEVEL_WARNING : APP_LOG_LEVEL_INFO,
+            "Heap (%s): used %u, free %u, peak %u, budget %u for %u devices and %u actions%s",
+            when, (unsigned)used, (unsigned)heap_bytes_free(), (unsigned)profile_stats.peakHeapUsed, (unsigned)budget,
+            deviceCapacity, actionCapacity, (used > budget)? ", OVER BUDGET" : "");
+}
+
+static void profile_record(uint8_t handler, uint32_t startMs) {
+    uint32_t elapsedMs = now_ms() - startMs;
+    ProfileHandlerStats *stats = &profile_stats.handlers[handler];
+    stats->calls++;
+    stats->totalMs += elapsedMs;
+    if (elapsedMs > stats->maxMs) {
+        stats->maxMs = elapsedMs;
+    }
+    profile_sample_heap();
+}
+
+static void profile_log(const char *when) {
+    APP_LOG(APP_LOG_LEVEL_INFO, "Profile (%s): messages received %lu, dropped %lu, sent %lu, failed %lu; peak heap %u",
+            when, profile_stats.messagesReceived, profile_stats.messagesDropped, profile_stats.messagesSent,
+            profile_stats.messagesFailed, (unsigned)profile_stats.peakHeapUsed);
+    APP_LOG(APP_LOG_LEVEL_INFO, "Profile (%s): commands retried %lu, collapsed %lu, abandoned %lu",
+            when, profile_stats.commandsRetried, profile_stats.commandsCollapsed, profile_stats.commandsAbandoned);
+    uint32_t rowsDrawn = profile_stats.handlers[PROFILE_DRAW_ROW].calls;
+    APP_LOG(APP_LOG_LEVEL_INFO, "Profile (%s): redraws %lu, coalesced %lu; rows drawn since last log %lu",
+            when, profile_stats.redraws, profile_stats.redrawsCoalesced, rowsDrawn - profile_stats.rowsDrawnAtLastLog);
+    profile_stats.rowsDrawnAtLastLog = rowsDrawn;
+    for (int i = 0; i < PROFILE_HANDLER_COUNT; i++) {
+        ProfileHandlerStats *stats = &profile_stats.handlers[i];
+        APP_LOG(APP_LOG_LEVEL_INFO, "Profile (%s): %s calls %lu, total %lu ms, max %lu ms",
+                when, profile_handler_names[i], stats->calls, stats->totalMs, stats->maxMs);
+    }
+}
+
+#define PROFILE_BEGIN() uint32_t profileStartMs = now_ms()
+#define PROFILE_END(handler) profile_record(handler, profileStartMs)
+#define PROFILE_COUNT(counter) (profile_stats.counter++)
+#define PROFILE_LOG(when) profile_log(when)
+#define PROFILE_HEAP(when) profile_heap(when)
+
+#else
+
+#define PROFILE_BEGIN()
+#define PROFILE_END(handler)
+#define PROFILE_COUNT(counter)
+#define PROFILE_LOG(when)
+#define PROFILE_HEAP(when)
+
+#endif
+
+
+/******* RECORD STORAGE *******/
+
+static const char *pool_name(uint16_t name) {
+    switch (name) {
+        case NAME_LOADING:
+            return "Loading...";
+        case NAME_UNAVAILABLE:
+            return "(Out of memory)";
+        default:
+            return &name_pool[name];
+    }
+}
+
+// The given device, or NULL if it's outside the window of devices we hold
+static DeviceData *device_data(uint16_t deviceNumber) {
+    if ((deviceNumber < deviceWindowStart) || (deviceNumber - deviceWindowStart >= deviceCapacity)) {
+        return NULL;
+    }
+    return &device_data_list[deviceNumber - deviceWindowStart];
+}
+
+static const char *device_name(uint16_t deviceNumber) {
+    DeviceData *device = device_data(deviceNumber);
+    return pool_name(device ? device->name : NAME_LOADING);
+}
+
+// The state shown for the given device, without any mark that switching it failed, is queued or is stale
+static uint8_t device_state(uint16_t deviceNumber) {
+    DeviceData *device = device_data(deviceNumber);
+    if (device == NULL) {
+        return STATUS_GETTING_STATE;
+    }
+    switch (device->on) {
+        case STATUS_FAILED_ON:
+        case STATUS_QUEUED_ON:
+        case STATUS_STALE_ON:
+            return STATUS_ON;
+        case STATUS_FAILED_OFF:
+        case STATUS_QUEUED_OFF:
+        case STATUS_STALE_OFF:
+            return STATUS_OFF;
+        default:
+            return device->on;
+    }
+}
+
+static const char *action_name(uint16_t actionNumber) {
+    return pool_name(action_data_list[actionNumber].name);
+}
+
+// Length to cut the given string to so it fits in maxLength bytes without splitting a UTF-8 character
+static uint16_t utf8_truncated_length(const char *string, uint16_t maxLength) {
+    uint16_t length = strlen(string);
+    if (length <= maxLength) {
+        return length;
+    }
+    length = maxLength;
+    while ((length > 0) && ((string[length] & 0xC0) == 0x80)) {
+        length--;
+    }
+    return length;
+}
+
+// Grow the device list to hold count devices; returns how many it can hold
+static uint16_t device_reserve(uint16_t count) {
+    if (count > MAX_NUMBER_OF_DEVICES) {
+        count = MAX_NUMBER_OF_DEVICES;
+    }
+    if (count > deviceCapacity) {
+        DeviceData *grown = realloc(device_data_list, count * sizeof(DeviceData));
+        if (grown == NULL) {
+            APP_LOG(APP_LOG_LEVEL_WARNING, "No room for %u devices", count);
+            return deviceCapacity;
+        }
+        for (uint16_t i = deviceCapacity; i < count; i++) {
+            grown[i] = (DeviceData){ .name = NAME_LOADING, .on = STATUS_GETTING_STATE };
+        }
+        device_data_list = grown;
+        deviceCapacity = count;
+    }
+    return count;
+}
+
+// Grow the action list to hold count actions; returns how many it can hold
+static uint16_t action_reserve(uint16_t count) {
+    if (count > MAX_NUMBER_OF_ACTIONS) {
+        count = MAX_NUMBER_OF_ACTIONS;
+    }
+    if (count > actionCapacity) {
+        ActionData *grown = realloc(action_data_list, count * sizeof(ActionData));
+        if (grown == NULL) {
+            APP_LOG(APP_LOG_LEVEL_WARNING, "No room for %u actions", count);
+            return actionCapacity;
+        }
+        for (uint16_t i = actionCapacity; i < count; i++) {
+            grown[i] = (ActionData){ .name = NAME_LOADING, .status = STATUS_NONE };
+        }
+        action_data_list = grown;
+        actionCapacity = count;
+    }
+    return count;
+}
+
+// Forget the given rows, e.g. as they leave the window of a paged list
+static void device_release(DeviceData *device, uint16_t count) {
+    for (uint16_t i = 0; i < count; i++) {
+        if ((device[i].name != NAME_LOADING) && (device[i].name != NAME_UNAVAILABLE)) {
+            namePoolGarbage += strlen(&name_pool[device[i].name]) + 1;
+        }
+        device[i] = (DeviceData){ .name = NAME_LOADING, .on = STATUS_GETTING_STATE };
+    }
+}
+
+// Forget the given actions, e.g. as a shorter list leaves them behind
+static void action_release(ActionData *action, uint16_t count) {
+    for (uint16_t i = 0; i < count; i++) {
+        if ((action[i].name != NAME_LOADING) && (action[i].name != NAME_UNAVAILABLE)) {
+            namePoolGarbage += strlen(&name_pool[action[i].name]) + 1;
+        }
+        action[i] = (ActionData){ .name = NAME_LOADING, .status = STATUS_NONE };
+    }
+}
+
+// Slide the window of a paged list to start at the given device, keeping the rows it still covers
+static void device_window_move(uint16_t start) {
+    uint16_t shift;
+    if (start > deviceWindowStart) {
+        shift = ((uint32_t)start - deviceWindowStart < deviceCapacity)? start - deviceWindowStart : deviceCapacity;
+        device_release(device_data_list, shift);
+        memmove(device_data_list, &device_data_list[shift], (deviceCapacity - shift) * sizeof(DeviceData));
+        for (uint16_t i = deviceCapacity - shift; i < deviceCapacity; i++) {
+            device_data_list[i] = (DeviceData){ .name = NAME_LOADING, .on = STATUS_GETTING_STATE };
+        }
+    }
+    else {
+        shift = ((uint32_t)deviceWindowStart - start < deviceCapacity)? deviceWindowStart - start : deviceCapacity;
+        device_release(&device_data_list[deviceCapacity - shift], shift);
+        memmove(&device_data_list[shift], device_data_list, (deviceCapacity - shift) * sizeof(DeviceData));
+        for (uint16_t i = 0; i < shift; i++) {
+            device_data_list[i] = (DeviceData){ .name = NAME_LOADING, .on = STATUS_GETTING_STATE };
+        }
+    }
+    deviceWindowStart = start;
+}
+
+// Switch between holding every device and holding a window of a paged list, which starts out at the top
+static void device_set_paged(bool paged) {
+    if (paged == devicesPaged) {
+        return;
+    }
+    devicesPaged = paged;
+    device_window_move(0);
+    if (paged && (deviceCapacity > DEVICE_WINDOW_SIZE)) {
+        // Hand back the memory of rows beyond the window
+        device_release(&device_data_list[DEVICE_WINDOW_SIZE], deviceCapacity - DEVICE_WINDOW_SIZE);
+        DeviceData *shrunk = realloc(device_data_list, DEVICE_WINDOW_SIZE * sizeof(DeviceData));
+        if (shrunk != NULL) {
+            device_data_list = shrunk;
+        }
+        deviceCapacity = DEVICE_WINDOW_SIZE;
+    }
+}
+
+static void name_pool_copy(char *pool, uint16_t *used, uint16_t *name) {
+    if ((*name != NAME_LOADING) && (*name != NAME_UNAVAILABLE)) {
+        uint16_t length = strlen(&name_pool[*name]) + 1;
+        memcpy(&pool[*used], &name_pool[*name], length);
+        *name = *used;
+        *used += length;
+    }
+}
+
+// Move every name into a fresh pool of the given size, dropping the garbage left by replaced names
+static bool name_pool_rebuild(uint16_t size) {
+    char *pool = malloc(size);
+    if (pool == NULL) {
+        return false;
+    }
+    uint16_t used = 0;
+    for (uint16_t i = 0; i < deviceCapacity; i++) {
+        name_pool_copy(pool, &used, &device_data_list[i].name);
+    }
+    for (uint16_t i = 0; i < actionCapacity; i++) {
+        name_pool_copy(pool, &used, &action_data_list[i].name);
+    }
+    free(name_pool);
+    name_pool = pool;
+    namePoolSize = size;
+    namePoolUsed = used;
+    namePoolGarbage = 0;
+    return true;
+}
+
+// The record name at the lowest offset above after, or NULL if there's none
+static uint16_t *name_pool_next(int32_t after) {
+    uint16_t *next = NULL;
+    for (uint16_t i = 0; i < deviceCapacity; i++) {
+        uint16_t *name = &device_data_list[i].name;
+        if ((*name < NAME_UNAVAILABLE) && ((int32_t)*name > after) && (!next || (*name < *next))) {
+            next = name;
+        }
+    }
+    for (uint16_t i = 0; i < actionCapacity; i++) {
+        uint16_t *name = &action_data_list[i].name;
+        if ((*name < NAME_UNAVAILABLE) && ((int32_t)*name > after) && (!next || (*name < *next))) {
+            next = name;
+        }
+    }
+    return next;
+}
+
+// Drop the garbage by sliding every name down the pool in place, for when there's no heap for a second
+// pool; names go in the order they sit in the pool, so each only ever moves down over space already passed.
+// Finding that order takes a pass over the records for each name, so this is only for when the heap is short.
+static void name_pool_compact(void) {
+    uint16_t used = 0;
+    int32_t after = -1;
+    for (uint16_t *name = name_pool_next(after); name; name = name_pool_next(after)) {
+        after = *name;
+        uint16_t length = strlen(&name_pool[*name]) + 1;
+        memmove(&name_pool[used], &name_pool[*name], length);
+        *name = used;
+        used += length;
+    }
+    namePoolUsed = used;
+    namePoolGarbage = 0;
+}
+
+// Make sure the pool is at least size bytes, for when the counts tell us how many names are coming
+static void name_pool_presize(uint32_t size) {
+    if (size > MAX_NAME_POOL_SIZE) {
+        size = MAX_NAME_POOL_SIZE;
+    }
+    if (size > namePoolSize) {
+        name_pool_rebuild(size);
+    }
+}
+
+// Make room for needed more bytes in the pool, compacting and growing it as required;
+// returns how many bytes are available, which is fewer than needed once the pool is full
+static uint16_t name_pool_reserve(uint16_t needed) {
+    if ((uint32_t)namePoolUsed + needed <= namePoolSize) {
+        return needed;
+    }
+    uint32_t size = (uint32_t)namePoolSize * 2;
+    if (size < (uint32_t)namePoolUsed - namePoolGarbage + needed) {
+        size = (uint32_t)namePoolUsed - namePoolGarbage + needed;
+    }
+    if (size > MAX_NAME_POOL_SIZE) {
+        size = MAX_NAME_POOL_SIZE;
+    }
+    if ((size > namePoolSize) || (namePoolGarbage > 0)) {
+        if (!name_pool_rebuild(size) && (namePoolGarbage > 0)) {
+            // Not enough heap to grow, or to hold a second pool, but we may still reclaim the garbage in place
+            name_pool_compact();
+        }
+    }
+    return ((uint32_t)namePoolUsed + needed <= namePoolSize)? needed : namePoolSize - namePoolUsed;
+}
+
+// Store value as the given record's name, reusing its current space when the new name fits there.
+// Once the pool is full names are truncated to the space left, then shown as unavailable.
+static void name_pool_store(uint16_t *name, const char *value, uint16_t maxLength) {
+    uint16_t length = utf8_truncated_length(value, maxLength - 1);
+    
+    if ((*name != NAME_LOADING) && (*name != NAME_UNAVAILABLE)) {
+        uint16_t currentLength = strlen(&name_pool[*name]);
+        if (length <= currentLength) {
+            memcpy(&name_pool[*name], value, length);
+            name_pool[*name + length] = '\0';
+            namePoolGarbage += currentLength - length;
+            return;
+        }
+        namePoolGarbage += currentLength + 1;
+        *name = NAME_LOADING;
+    }
+    
+    uint16_t available = name_pool_reserve(length + 1);
+    if (available < length + 1) {
+        APP_LOG(APP_LOG_LEVEL_WARNING, "Name pool full, truncating name");
+        if (available == 0) {
+            *name = NAME_UNAVAILABLE;
+            return;
+        }
+        length = utf8_truncated_length(value, available - 1);
+    }
+    memcpy(&name_pool[namePoolUsed], value, length);
+    name_pool[namePoolUsed + length] = '\0';
+    *name = namePoolUsed;
+    namePoolUsed += length + 1;
+}
+
+// Forget every name, e.g. when the configuration changes and all of the lists will be resent
+static void records_clear(void) {
+    for (uint16_t i = 0; i < deviceCapacity; i++) {
+        device_data_list[i] = (DeviceData){ .name = NAME_LOADING, .on = STATUS_GETTING_STATE };
+    }
+    for (uint16_t i = 0; i < actionCapacity; i++) {
+        action_data_list[i] = (ActionData){ .name = NAME_LOADING, .status = STATUS_NONE };
+    }
+    namePoolUsed = 0;
+    namePoolGarbage = 0;
+}
+
+static void records_destroy(void) {
+    free(device_data_list);
+    free(action_data_list);
+    free(name_pool);
+}
+
+
+/******* SNAPSHOT PERSISTENCE *******/
+
+typedef struct {
+    uint8_t version;
+    uint8_t chunkCount;
+    uint16_t deviceCount;
+    uint16_t actionCount;
+    uint32_t deviceSnapshotVersion;
+    uint32_t actionSnapshotVersion;
+} SnapshotHeader;
+
+// Buffers one chunk of the snapshot while it is written or read
+typedef struct {
+    uint8_t buffer[PERSIST_DATA_MAX_LENGTH];
+    uint16_t offset;
+    uint16_t length;
+    uint8_t chunk;
+} SnapshotStream;
+
+static SnapshotStream snapshot_stream;
+
+// Bytes left in the snapshot for more records
+static uint16_t snapshot_space_remaining(void) {
+    return ((MAX_SNAPSHOT_CHUNKS - snapshot_stream.chunk) * PERSIST_DATA_MAX_LENGTH) - snapshot_stream.offset;
+}
+
+static void snapshot_flush(void) {
+    if (snapshot_stream.offset > 0) {
+        persist_write_data(PERSIST_KEY_SNAPSHOT_FIRST_CHUNK + snapshot_stream.chunk, snapshot_stream.buffer, snapshot_stream.offset);
+        snapshot_stream.chunk++;
+        snapshot_stream.offset = 0;
+    }
+}
+
+// Callers check snapshot_space_remaining() first, so a record is never split off the end of the snapshot
+static void snapshot_write(const void *data, uint16_t length) {
+    const uint8_t *bytes = data;
+    while (length > 0) {
+        if (snapshot_stream.offset == PERSIST_DATA_MAX_LENGTH) {
+            snapshot_flush();
+        }
+        uint16_t count = PERSIST_DATA_MAX_LENGTH - snapshot_stream.offset;
+        if (count > length) {
+            count = length;
+        }
+        memcpy(&snapshot_stream.buffer[snapshot_stream.offset], bytes, count);
+        snapshot_stream.offset += count;
+        bytes += count;
+        length -= count;
+    }
+}
+
+static bool snapshot_read(void *data, uint16_t length, uint8_t chunkCount) {
+    uint8_t *bytes = data;
+    while (length > 0) {
+        if (snapshot_stream.offset == snapshot_stream.length) {
+            if (snapshot_stream.chunk >= chunkCount) {
+                return false;
+            }
+            int read = persist_read_data(PERSIST_KEY_SNAPSHOT_FIRST_CHUNK + snapshot_stream.chunk, snapshot_stream.buffer, PERSIST_DATA_MAX_LENGTH);
+            if (read <= 0) {
+                return false;
+            }
+            snapshot_stream.chunk++;
+            snapshot_stream.offset = 0;
+            snapshot_stream.length = read;
+        }
+        uint16_t count = snapshot_stream.length - snapshot_stream.offset;
+        if (count > length) {
+            count = length;
+        }
+        memcpy(bytes, &snapshot_stream.buffer[snapshot_stream.offset], count);
+        snapshot_stream.offset += count;
+        bytes += count;
+        length -= count;
+    }
+    return true;
+}
+
+// Write a length prefixed name, truncated to MAX_SNAPSHOT_NAME_LENGTH without splitting a UTF-8 character;
+// returns false if there isn't room for it plus extraBytes in the snapshot
+static bool snapshot_write_record(const char *name, const uint8_t *extra, uint8_t extraBytes) {
+    uint8_t length = utf8_truncated_length(name, MAX_SNAPSHOT_NAME_LENGTH);
+    if (snapshot_space_remaining() < (uint16_t)(extraBytes + 1 + length)) {
+        return false;
+    }
+    snapshot_write(extra, extraBytes);
+    snapshot_write(&length, 1);
+    snapshot_write(name, length);
+    return true;
+}
+
+static bool snapshot_read_name(uint16_t *name, uint16_t maxLength, uint8_t chunkCount) {
+    char value[MAX_SNAPSHOT_NAME_LENGTH + 1];
+    uint8_t length;
+    if (!snapshot_read(&length, 1, chunkCount) || (length > MAX_SNAPSHOT_NAME_LENGTH) ||
+        !snapshot_read(value, length, chunkCount)) {
+        return false;
+    }
+    value[length] = '\0';
+    name_pool_store(name, value, maxLength);
+    return true;
+}
+
+// Persist the devices and actions we know of so the next launch can show them straight away
+static void snapshot_save(void) {
+    SnapshotHeader header = {
+        .version = SNAPSHOT_VERSION,
+        .deviceCount = 0,
+        .actionCount = 0,
+        .deviceSnapshotVersion = deviceSnapshotVersion,
+        .actionSnapshotVersion = actionSnapshotVersion
+    };
+    memset(&snapshot_stream, 0, sizeof(snapshot_stream));
+    
+    // Only a window of a paged list is held, so there is nothing worth saving of it
+    if ((gotDeviceCount == STATUS_LOADED) && !devicesPaged) {
+        for (; header.deviceCount < deviceCount; header.deviceCount++) {
+            DeviceData *device = &device_data_list[header.deviceCount];
+            // Devices caught mid-toggle are restored as still getting their state
+            uint8_t on = ((device->on == STATUS_ON) || (device->on == STATUS_OFF) || (device->on == STATUS_STALE_ON) ||
+                          (device->on == STATUS_STALE_OFF))? device_state(header.deviceCount) : STATUS_GETTING_STATE;
+            if (on == STATUS_GETTING_STATE) {
+                header.deviceSnapshotVersion = 0;
+            }
+            if (!snapshot_write_record(device_name(header.deviceCount), &on, sizeof(on))) {
+                break;
+            }
+        }
+    }
+    // A partial list no longer matches the version the phone sent
+    if ((gotDeviceCount != STATUS_LOADED) || (header.deviceCount < deviceCount)) {
+        header.deviceSnapshotVersion = 0;
+    }
+    if (gotActionCount == STATUS_LOADED) {
+        for (; header.actionCount < actionCount; header.actionCount++) {
+            if (!snapshot_write_record(action_name(header.actionCount), NULL, 0)) {
+                break;
+            }
+        }
+    }
+    if ((gotActionCount != STATUS_LOADED) || (header.actionCount < actionCount)) {
+        header.actionSnapshotVersion = 0;
+    }
+    snapshot_flush();
+    header.chunkCount = snapshot_stream.chunk;
+    
+    // Clear out chunks left over from a larger snapshot
+    for (uint8_t chunk = header.chunkCount; chunk < MAX_SNAPSHOT_CHUNKS; chunk++) {
+        if (persist_exists(PERSIST_KEY_SNAPSHOT_FIRST_CHUNK + chunk)) {
+            persist_delete(PERSIST_KEY_SNAPSHOT_FIRST_CHUNK + chunk);
+        }
+    }
+    
+    persist_write_data(PERSIST_KEY_SNAPSHOT_HEADER, &header, sizeof(header));
+}
+
+// Restore the devices and actions persisted by the last launch; live sync updates them as it arrives
+static void snapshot_restore(void) {
+    SnapshotHeader header;
+    if (persist_read_data(PERSIST_KEY_SNAPSHOT_HEADER, &header, sizeof(header)) != sizeof(header)) {
+        return;
+    }
+    if ((header.version != SNAPSHOT_VERSION) || (header.chunkCount > MAX_SNAPSHOT_CHUNKS)) {
+        APP_LOG(APP_LOG_LEVEL_DEBUG, "Ignoring incompatible snapshot");
+        return;
+    }
+    memset(&snapshot_stream, 0, sizeof(snapshot_stream));
+    
+    uint16_t deviceLimit = device_reserve(header.deviceCount);
+    uint16_t actionLimit = action_reserve(header.actionCount);
+    name_pool_presize((uint32_t)(deviceLimit + actionLimit) * NAME_POOL_BYTES_PER_RECORD);
+    
+    for (deviceCount = 0; deviceCount < deviceLimit; deviceCount++) {
+        DeviceData *device = &device_data_list[deviceCount];
+        if (!snapshot_read(&device->on, sizeof(device->on), header.chunkCount) ||
+            !snapshot_read_name(&device->name, MAX_DEVICE_NAME_LENGTH, header.chunkCount)) {
+            break;
+        }
+        // Any of the states may have changed since, so they're shown as stale until the phone confirms them
+        if (device->on == STATUS_ON) {
+            device->on = STATUS_STALE_ON;
+        }
+        else if (device->on == STATUS_OFF) {
+            device->on = STATUS_STALE_OFF;
+        }
+    }
+    // A device is only counted when its record was read in full, so a truncated snapshot can't restore actions
+    if (deviceCount == header.deviceCount) {
+        for (actionCount = 0; actionCount < actionLimit; actionCount++) {
+            if (!snapshot_read_name(&action_data_list[actionCount].name, MAX_ACTION_NAME_LENGTH, header.chunkCount)) {
+                break;
+            }
+            action_data_list[actionCount].status = STATUS_NONE;
+        }
+    }
+    
+    if (deviceCount > 0) {
+        gotDeviceCount = STATUS_LOADED;
+    }
+    if (deviceCount == header.deviceCount) {
+        deviceSnapshotVersion = header.deviceSnapshotVersion;
+    }
+    if (actionCount > 0) {
+        gotActionCount = STATUS_LOADED;
+    }
+    if ((deviceCount == header.deviceCount) && (actionCount == header.actionCount)) {
+        actionSnapshotVersion = header.actionSnapshotVersion;
+    }
+}
+
+
+/******* REDRAW SCHEDULING *******/
+
+// What needs redrawing; a reload also redraws
+#define REDRAW_TOP 0x01
+#define REDRAW_DEVICES 0x02
+#define REDRAW_ACTIONS 0x04
+#define RELOAD_DEVICES 0x08
+#define RELOAD_ACTIONS 0x10
+
+static uint8_t redrawPending = 0;
+static AppTimer *redraw_timer = NULL;
+
+// Redraw whatever was marked since the last redraw, if it's on screen; a window that comes on screen later
+// draws itself anyway
+static void redraw_timer_callback(void *data) {
+    redraw_timer = NULL;
+    uint8_t pending = redrawPending;
+    redrawPending = 0;
+    PROFILE_COUNT(redraws);
+    
+    Window *top = window_stack_get_top_window();
+    if ((top == top_window) && (pending & REDRAW_TOP)) {
+        layer_mark_dirty(menu_layer_get_layer(top_menu_layer));
+    }
+    else if (top == devices_window) {
+        if (pending & RELOAD_DEVICES) {
+            menu_layer_reload_data(devices_menu_layer);
+        }
+        else if (pending & REDRAW_DEVICES) {
+            layer_mark_dirty(menu_layer_get_layer(devices_menu_layer));
+        }
+    }
+    else if (top == actions_window) {
+        if (pending & RELOAD_ACTIONS) {
+            menu_layer_reload_data(actions_menu_layer);
+        }
+        else if (pending & REDRAW_ACTIONS) {
+            layer_mark_dirty(menu_layer_get_layer(actions_menu_layer));
+        }
+    }
+}
+
+static void redraw_schedule(uint8_t what) {
+    redrawPending |= what;
+    if (redraw_timer == NULL) {
+        redraw_timer = app_timer_register(REDRAW_INTERVAL_MS, redraw_timer_callback, NULL);
+    }
+    else {
+        PROFILE_COUNT(redrawsCoalesced);
+    }
+}
+
+
+/******* MESSAGE PASSING WITH PHONE BASED PEBBLE APP *******/
+
+// Integers arrive 1, 2 or 4 bytes wide depending on the sender
+static uint32_t tuple_uint(const Tuple *tuple) {
+    switch (tuple->length) {
+        case 1:
+            return tuple->value->uint8;
+        case 2:
+            return tuple->value->uint16;
+        default:
+            return tuple->value->uint32;
+    }
+}
+
+// Copy the given device info into our list; returns true if stored
+static bool store_device_info(int32_t deviceNumber, const char *name, bool on, bool stale) {
+    DeviceData *device = ((deviceNumber >= 0) && (deviceNumber <= UINT16_MAX))? device_data(deviceNumber) : NULL;
+    if (device == NULL) {
+        return false;
+    }
+    
+    name_pool_store(&device->name, name, MAX_DEVICE_NAME_LENGTH);
+    if (stale) {
+        device->on = on ? STATUS_STALE_ON : STATUS_STALE_OFF;
+    }
+    else {
+        device->on = on ? STATUS_ON : STATUS_OFF;
+    }
+    return true;
+}
+
+// Copy the given action info into our list; returns true if stored
+static bool store_action_info(int32_t actionNumber, const char *name) {
+    if ((actionNumber < 0) || (actionNumber >= actionCapacity)) {
+        return false;
+    }
+    
+    ActionData *action = &action_data_list[actionNumber];
+    name_pool_store(&action->name, name, MAX_ACTION_NAME_LENGTH);
+    action->status = STATUS_NONE;
+    return true;
+}
+
+// Store every device or action record packed into the given byte array, stopping at the first
+// malformed one; returns the number of the last record stored, or -1 if none was
+static int32_t store_records(Tuple *records, bool devices) {
+    const uint8_t *data = records->value->data;
+    uint16_t offset = 0;
+    int32_t number = -1, lastStored = -1;
+    
+    while (offset < records->length) {
+        uint32_t zigzag = 0;
+        uint8_t shift = 0, byte;
+        do {
+            if ((offset >= records->length) || (shift > 28)) {
+                APP_LOG(APP_LOG_LEVEL_WARNING, "Malformed record");
+                return lastStored;
+            }
+            byte = data[offset++];
+            zigzag |= (uint32_t)(byte & 0x7F) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+        number += 1 + (int32_t)((zigzag >> 1) ^ -(zigzag & 1));
+        
+        uint8_t nameLength = (offset < records->length)? (data[offset] & RECORD_NAME_LENGTH_MASK) >> 1 : MAX_RECORD_NAME_LENGTH + 1;
+        if ((nameLength > MAX_RECORD_NAME_LENGTH) || (offset + 1 + nameLength > records->length)) {
+            APP_LOG(APP_LOG_LEVEL_WARNING, "Malformed record");
+            return lastStored;
+        }
+        bool on = data[offset] & RECORD_ON_BIT;
+        bool stale = data[offset++] & RECORD_STALE_BIT;
+        char name[MAX_RECORD_NAME_LENGTH + 1];
+        memcpy(name, &data[offset], nameLength);
+        name[nameLength] = '\0';
+        offset += nameLength;
+        
+        if (devices ? store_device_info(number, name, on, stale) : store_action_info(number, name)) {
+            lastStored = number;
+        }
+    }
+    return lastStored;
+}
+
+static void mark_device_dirty(void) {
+    redraw_schedule(REDRAW_DEVICES);
+}
+
+static void mark_action_dirty(void) {
+    redraw_schedule(REDRAW_ACTIONS);
+}
+
+static bool pending_in_use(const PendingCommand *pending) {
+    return pending->timer || pending->queued;
+}
+
+static PendingCommand *pending_find(bool device, uint16_t number) {
+    for (uint8_t i = 0; i < MAX_PENDING_COMMANDS; i++) {
+        if (pending_in_use(&pending_commands[i]) && (pending_commands[i].device == device) && (pending_commands[i].number == number)) {
+            return &pending_commands[i];
+        }
+    }
+    return NULL;
+}
+
+// Stop waiting on the slot and free it
+static void pending_release(PendingCommand *pending) {
+    if (pending->timer) {
+        app_timer_cancel(pending->timer);
+        pending->timer = NULL;
+    }
+    pending->queued = false;
+}
+
+static void pending_timeout_callback(void *data);
+
+// Start waiting for the phone to confirm a command for the given row; a row already waiting (or queued)
+// keeps the state it had before the first of its commands, and waits from now
+static void pending_begin(bool device, uint16_t number, uint8_t rollback) {
+    PendingCommand *pending = pending_find(device, number);
+    if (pending) {
+        if (pending->timer) {
+            app_timer_reschedule(pending->timer, COMMAND_TIMEOUT_MS);
+        }
+        else {
+            pending->timer = app_timer_register(COMMAND_TIMEOUT_MS, pending_timeout_callback, pending);
+        }
+        pending->queued = false;
+        pending->clickedAt = now_ms();
+        return;
+    }
+    for (uint8_t i = 0; i < MAX_PENDING_COMMANDS; i++) {
+        if (!pending_in_use(&pending_commands[i])) {
+            pending_commands[i] = (PendingCommand){ .device = device, .number = number, .rollback = rollback, .clickedAt = now_ms() };
+            pending_commands[i].timer = app_timer_register(COMMAND_TIMEOUT_MS, pending_timeout_callback, &pending_commands[i]);
+            return;
+        }
+    }
+    APP_LOG(APP_LOG_LEVEL_DEBUG, "Too many commands waiting, not timing this one");
+}
+
+// The phone confirmed the row's state
+static void pending_settle(bool device, uint16_t number) {
+    PendingCommand *pending = pending_find(device, number);
+    if (pending) {
+        pending_release(pending);
+        trace_record(TRACE_ROUND_TRIP, pending->clickedAt);
+        trace_render_begin(device, number);
+    }
+}
+
+// The phone has the given command
+static void pending_sent(const Command *command) {
+    bool device = (command->type == COMMAND_TOGGLE) || (command->type == COMMAND_DIM);
+    if (device || (command->type == COMMAND_EXECUTE)) {
+        PendingCommand *pending = pending_find(device, command->number);
+        if (pending) {
+            trace_record(TRACE_SEND, pending->clickedAt);
+        }
+    }
+}
+
+// Put a row whose command failed back to the given state, showing that it failed
+static void row_failed(bool device, uint16_t number, uint8_t rollback) {
+    if (device) {
+        DeviceData *data = device_data(number);
+        if (data && (number < deviceCount)) {
+            data->on = (rollback == STATUS_ON)? STATUS_FAILED_ON : (rollback == STATUS_OFF)? STATUS_FAILED_OFF : STATUS_FAILED;
+            mark_device_dirty();
+        }
+    }
+    else if (number < actionCount) {
+        action_data_list[number].status = STATUS_FAILED;
+        mark_action_dirty();
+    }
+}
+
+// The command for the given row failed, so put the row back to how it was before
+static void pending_fail(bool device, uint16_t number) {
+    PendingCommand *pending = pending_find(device, number);
+    if (pending) {
+        pending_release(pending);
+        row_failed(device, number, pending->rollback);
+    }
+    else {
+        row_failed(device, number, device ? device_state(number) : STATUS_NONE);
+    }
+}
+
+// The phone couldn't reach the Indigo Server, so is holding the command for the given row until it can;
+// the row keeps the state asked for, marked as queued, and stops timing out, as the phone confirms or fails
+// the command whenever it gets through; the slot keeps what to roll back to for when it fails
+static void pending_queue(bool device, uint16_t number) {
+    PendingCommand *pending = pending_find(device, number);
+    if (pending) {
+        if (pending->timer) {
+            app_timer_cancel(pending->timer);
+            pending->timer = NULL;
+        }
+        pending->queued = true;
+    }
+    if (device) {
+        DeviceData *data = device_data(number);
+        if (data && (number < deviceCount)) {
+            uint8_t on = device_state(number);
+            data->on = (on == STATUS_ON)? STATUS_QUEUED_ON : (on == STATUS_OFF)? STATUS_QUEUED_OFF : STATUS_QUEUED;
+            mark_device_dirty();
+        }
+    }
+    else if (number < actionCount) {
+        action_data_list[number].status = STATUS_QUEUED;
+        mark_action_dirty();
+    }
+}
+
+static void pending_timeout_callback(void *data) {
+    PendingCommand *pending = data;
+    APP_LOG(APP_LOG_LEVEL_DEBUG, "Command timed out");
+    pending->timer = NULL; // Already fired, so not to be cancelled
+    row_failed(pending->device, pending->number, pending->rollback);
+}
+
+static void pending_clear(void) {
+    for (uint8_t i = 0; i < MAX_PENDING_COMMANDS; i++) {
+        pending_release(&pending_commands[i]);
+    }
+}
+
+// The group command is over, one way or the other; queuedCount of its devices are left for the phone to
+// switch once it can reach the Indigo Server
+static void group_settle(uint8_t status, uint16_t failedCount, uint16_t queuedCount) {
+    if (group_timeout_timer) {
+        app_timer_cancel(group_timeout_timer);
+        group_timeout_timer = NULL;
+    }
+    groupStatus = status;
+    groupFailedCount = failedCount;
+    groupQueuedCount = queuedCount;
+    redraw_schedule(REDRAW_TOP);
+}
+
+static void group_timeout_callback(void *data) {
+    group_timeout_timer = NULL;
+    group_settle(STATUS_FAILED, 0, 0);
+}
+
+static void devices_and_actions_msg(void);
+
+static bool lists_loading(void) {
+    return (gotDeviceCount == STATUS_LOADING) || (gotActionCount == STATUS_LOADING);
+}
+
+// Longest the phone may stay quiet while we wait for the lists
+static uint32_t loading_timeout_ms(void) {
+    uint32_t longest = 0;
+    for (uint8_t i = 0; i < LOADING_GAP_SAMPLES; i++) {
+        if (loadingGaps[i] > longest) {
+            longest = loadingGaps[i];
+        }
+    }
+    if (longest == 0) {
+        return LOADING_TIMEOUT_MS;
+    }
+    longest *= LOADING_TIMEOUT_FACTOR;
+    return (longest < LOADING_TIMEOUT_MIN_MS)? LOADING_TIMEOUT_MIN_MS : (longest > LOADING_TIMEOUT_MAX_MS)? LOADING_TIMEOUT_MAX_MS : longest;
+}
+
+static void loading_timeout_callback(void *data) {
+    loading_timeout_timer = NULL;
+    if (gotDeviceCount == STATUS_LOADING) {
+        gotDeviceCount = STATUS_COULD_NOT_CONNECT;
+    }
+    if (gotActionCount == STATUS_LOADING) {
+        gotActionCount = STATUS_COULD_NOT_CONNECT;
+    }
+    redraw_schedule(REDRAW_TOP);
+}
 
-typedef struct {
-    char name[MAX_ACTION_NAME_LENGTH];
-    uint8_t status;
-} ActionData;
+// Start waiting for the lists, or keep waiting if we already are
+static void loading_wait(void) {
+    if (loading_timeout_timer) {
+        app_timer_reschedule(loading_timeout_timer, loading_timeout_ms());
+        return;
+    }
+    loadingHeardAt = now_ms();
+    loadingLongestGap = 0;
+    loading_timeout_timer = app_timer_register(loading_timeout_ms(), loading_timeout_callback, NULL);
+}
 
-static ActionData action_data_list[MAX_NUMBER_OF_ACTIONS];
+// Heard from the phone, so while we wait for the lists push back the timeout; once both lists are in (or the
+// phone has said it can't get them), keep the longest it went quiet to size the timeout of future loads
+static void loading_heard(void) {
+    if (loading_timeout_timer == NULL) {
+        return;
+    }
+    uint32_t now = now_ms();
+    if (now - loadingHeardAt > loadingLongestGap) {
+        loadingLongestGap = now - loadingHeardAt;
+    }
+    loadingHeardAt = now;
+    if (lists_loading()) {
+        app_timer_reschedule(loading_timeout_timer, loading_timeout_ms());
+        return;
+    }
+    
+    app_timer_cancel(loading_timeout_timer);
+    loading_timeout_timer = NULL;
+    memmove(&loadingGaps[1], &loadingGaps[0], sizeof(loadingGaps) - sizeof(loadingGaps[0]));
+    loadingGaps[0] = (loadingLongestGap < UINT16_MAX)? loadingLongestGap : UINT16_MAX;
+    persist_write_data(PERSIST_KEY_LOADING_GAPS, loadingGaps, sizeof(loadingGaps));
+}
 
+static void loading_gaps_restore(void) {
+    if (persist_read_data(PERSIST_KEY_LOADING_GAPS, loadingGaps, sizeof(loadingGaps)) != sizeof(loadingGaps)) {
+        memset(loadingGaps, 0, sizeof(loadingGaps));
+    }
+}
 
-/******* MESSAGE PASSING WITH PHONE BASED PEBBLE APP *******/
+// Ask for the lists, again if the phone couldn't get them before
+static void loading_retry(void) {
+    if (gotDeviceCount == STATUS_COULD_NOT_CONNECT) {
+        gotDeviceCount = STATUS_LOADING;
+    }
+    if (gotActionCount == STATUS_COULD_NOT_CONNECT) {
+        gotActionCount = STATUS_LOADING;
+    }
+    redraw_schedule(REDRAW_TOP);
+    devices_and_actions_msg();
+    loading_wait();
+}
 
 static void in_received_handler(DictionaryIterator *iter, void *context) {
+    PROFILE_BEGIN();
+    PROFILE_COUNT(messagesReceived);
+    
     Tuple *device_count_complete_tuple = dict_find(iter, INDIGO_REMOTE_KEY_DEVICE_COUNT_COMPLETE);
+    Tuple *device_count_expected_tuple = dict_find(iter, INDIGO_REMOTE_KEY_DEVICE_COUNT_EXPECTED);
     Tuple *device_count_tuple = dict_find(iter, INDIGO_REMOTE_KEY_DEVICE_COUNT);
+    Tuple *device_paged_tuple = dict_find(iter, INDIGO_REMOTE_KEY_DEVICE_PAGED);
     Tuple *device_tuple = dict_find(iter, INDIGO_REMOTE_KEY_DEVICE);
+    Tuple *device_records_tuple = dict_find(iter, INDIGO_REMOTE_KEY_DEVICE_RECORDS);
     Tuple *action_count_complete_tuple = dict_find(iter, INDIGO_REMOTE_KEY_ACTION_COUNT_COMPLETE);
     Tuple *action_count_tuple = dict_find(iter, INDIGO_REMOTE_KEY_ACTION_COUNT);
     Tuple *action_tuple = dict_find(iter, INDIGO_REMOTE_KEY_ACTION);
+    Tuple *action_records_tuple = dict_find(iter, INDIGO_REMOTE_KEY_ACTION_RECORDS);
     Tuple *loading_tuple = dict_find(iter, INDIGO_REMOTE_KEY_LOADING);
+    Tuple *command_failed_tuple = dict_find(iter, INDIGO_REMOTE_KEY_COMMAND_FAILED);
+    Tuple *command_queued_tuple = dict_find(iter, INDIGO_REMOTE_KEY_COMMAND_QUEUED);
+    Tuple *could_not_connect_tuple = dict_find(iter, INDIGO_REMOTE_KEY_COULD_NOT_CONNECT);
+    Tuple *diagnostics_tuple = dict_find(iter, INDIGO_REMOTE_KEY_DIAGNOSTICS);
+    Tuple *group_failed_tuple = dict_find(iter, INDIGO_REMOTE_KEY_GROUP_FAILED);
+    Tuple *ready_tuple = dict_find(iter, INDIGO_REMOTE_KEY_READY);
+    Tuple *device_snapshot_version_tuple = dict_find(iter, INDIGO_REMOTE_KEY_DEVICE_SNAPSHOT_VERSION);
+    Tuple *action_snapshot_version_tuple = dict_find(iter, INDIGO_REMOTE_KEY_ACTION_SNAPSHOT_VERSION);
     
-    if (device_count_complete_tuple) {
-        if (device_count_tuple->value->uint8 <= MAX_NUMBER_OF_DEVICES) {
-            deviceCount = device_count_tuple->value->uint8;
+    if (device_count_tuple) {
+        device_set_paged(device_paged_tuple != NULL);
+    }
+    
+    // Any change to a list leaves it at an unknown version, unless the message says which version it completes;
+    // a paged list is never held in full, so has no version
+    if (device_count_tuple || device_records_tuple) {
+        deviceSnapshotVersion = (device_snapshot_version_tuple && !devicesPaged)? tuple_uint(device_snapshot_version_tuple) : 0;
+    }
+    if (action_count_tuple || action_records_tuple) {
+        actionSnapshotVersion = action_snapshot_version_tuple ? tuple_uint(action_snapshot_version_tuple) : 0;
+    }
+    
+    if (device_count_tuple) {
+        // The count arrives ahead of streamed devices as the list grows, and once more (marked complete)
+        // with the final count after the last device, so keep the rows we already have and only shrink
+        // the list (e.g. below what was restored from the snapshot) once the count is complete
+        uint16_t newDeviceCount;
+        if (devicesPaged) {
+            device_reserve(DEVICE_WINDOW_SIZE);
+            newDeviceCount = (tuple_uint(device_count_tuple) < MAX_NUMBER_OF_PAGED_DEVICES)? tuple_uint(device_count_tuple) : MAX_NUMBER_OF_PAGED_DEVICES;
         }
         else {
-            deviceCount = MAX_NUMBER_OF_DEVICES;
+            // The first count of a sync says how many devices to expect at most, so the list and the name pool
+            // grow once for all of them; growing the pool with each count copies every name each time, and
+            // holds the old pool and the new one at once
+            uint16_t reserveCount = tuple_uint(device_count_tuple);
+            if (device_count_expected_tuple && (tuple_uint(device_count_expected_tuple) > reserveCount)) {
+                reserveCount = tuple_uint(device_count_expected_tuple);
+            }
+            reserveCount = device_reserve(reserveCount);
+            newDeviceCount = (tuple_uint(device_count_tuple) < reserveCount)? tuple_uint(device_count_tuple) : reserveCount;
         }
+        name_pool_presize((uint32_t)(deviceCapacity + actionCount) * NAME_POOL_BYTES_PER_RECORD);
         
-        for (int i = 0; i < deviceCount; i++) {
-            strncpy(device_data_list[i].name, "Loading...", MAX_DEVICE_NAME_LENGTH);
-            device_data_list[i].on = STATUS_GETTING_STATE;
+        // Rows joining the list start out loading, and rows a complete count drops have their names
+        // counted as garbage, so the pool can take them back
+        uint16_t firstChanged = deviceCount, lastChanged = newDeviceCount;
+        if (device_count_complete_tuple && (newDeviceCount < deviceCount)) {
+            firstChanged = newDeviceCount;
+            lastChanged = deviceCount;
+        }
+        for (uint16_t i = firstChanged; i < lastChanged; i++) {
+            DeviceData *device = device_data(i);
+            if (device) {
+                device_release(device, 1);
+            }
+        }
+        if (device_count_complete_tuple || (newDeviceCount > deviceCount)) {
+            deviceCount = newDeviceCount;
+        }
+        if (device_count_complete_tuple) {
+            devicesPartial = (dict_find(iter, INDIGO_REMOTE_KEY_DEVICES_PARTIAL) != NULL);
         }
 
         gotDeviceCount = STATUS_LOADED;
-        if (window_stack_get_top_window() == top_window) {
-            layer_mark_dirty(menu_layer_get_layer(top_menu_layer));
-        }
+        redraw_schedule(REDRAW_TOP | RELOAD_DEVICES);
     }
     
-    if (device_tuple) {
-        // Add the device info to our list
-        Tuple *deviceNumber = dict_find(iter, INDIGO_REMOTE_KEY_DEVICE_NUMBER);
-        Tuple *name = dict_find(iter, INDIGO_REMOTE_KEY_DEVICE_NAME);
-        Tuple *on = dict_find(iter, INDIGO_REMOTE_KEY_DEVICE_ON);
-        
-        if (deviceNumber) {
-            if (deviceNumber->value->uint8 < MAX_NUMBER_OF_DEVICES) {
-                if (name) {
-                    strncpy(device_data_list[deviceNumber->value->uint8].name, name->value->cstring, MAX_DEVICE_NAME_LENGTH);
-                }
-                if (on) {
-                    device_data_list[deviceNumber->value->uint8].on = on->value->uint8;
-                }
-                
-                if (window_stack_get_top_window() == devices_window) {
-                    layer_mark_dirty(menu_layer_get_layer(devices_menu_layer));
-                }
+    if (device_records_tuple) {
+        // Add every device packed into this message, then redraw once; a single device marked as such
+        // is also how the phone confirms a toggle or dim
+        int32_t deviceNumber = store_records(device_records_tuple, true);
+        if (deviceNumber >= 0) {
+            if (device_tuple) {
+                pending_settle(true, deviceNumber);
             }
+            mark_device_dirty();
         }
     }
     
     if (action_count_complete_tuple) {
-        // Got action count
-        if (action_count_tuple->value->uint8 <= MAX_NUMBER_OF_ACTIONS) {
-            actionCount = action_count_tuple->value->uint8;
+        // Got action count; keep the rows we already have (e.g. restored from the snapshot)
+        uint16_t newActionCount = action_reserve(tuple_uint(action_count_tuple));
+        name_pool_presize((uint32_t)(deviceCount + newActionCount) * NAME_POOL_BYTES_PER_RECORD);
+        
+        // Rows joining the list start out loading, and rows it drops have their names counted as garbage
+        if (newActionCount > actionCount) {
+            action_release(&action_data_list[actionCount], newActionCount - actionCount);
         }
         else {
-            actionCount = MAX_NUMBER_OF_ACTIONS;
-        }
-        
-        for (int i = 0; i < actionCount; i++) {
-            strncpy(action_data_list[i].name, "Loading", MAX_ACTION_NAME_LENGTH);
-            action_data_list[i].status = STATUS_NONE;
+            action_release(&action_data_list[newActionCount], actionCount - newActionCount);
         }
+        actionCount = newActionCount;
         
         gotActionCount = STATUS_LOADED;
-        if (window_stack_get_top_window() == top_window) {
-            layer_mark_dirty(menu_layer_get_layer(top_menu_layer));
-        }
+        redraw_schedule(REDRAW_TOP | RELOAD_ACTIONS);
     }
     
-    if (action_tuple) {
-        // Add the action info to our list
-        Tuple *actionNumber = dict_find(iter, INDIGO_REMOTE_KEY_ACTION_NUMBER);
-        Tuple *name = dict_find(iter, INDIGO_REMOTE_KEY_ACTION_NAME);
-        
-        if (actionNumber) {
-            if (actionNumber->value->uint8 < MAX_NUMBER_OF_ACTIONS) {
-                if (name) {
-                    strncpy(action_data_list[actionNumber->value->uint8].name, name->value->cstring, MAX_ACTION_NAME_LENGTH);
-                }
-                action_data_list[actionNumber->value->uint8].status = STATUS_NONE;
-                
-                if (window_stack_get_top_window() == actions_window) {
-                    layer_mark_dirty(menu_layer_get_layer(actions_menu_layer));
-                }
+    if (action_records_tuple) {
+        // Add every action packed into this message, then redraw once; a single action marked as such
+        // is also how the phone confirms an action was executed
+        int32_t actionNumber = store_records(action_records_tuple, false);
+        if (actionNumber >= 0) {
+            if (action_tuple) {
+                pending_settle(false, actionNumber);
             }
+            mark_action_dirty();
+        }
+    }
+    
+    if (command_failed_tuple) {
+        // The phone couldn't carry out a toggle, dim or execute
+        Tuple *device_number_tuple = dict_find(iter, INDIGO_REMOTE_KEY_DEVICE_NUMBER);
+        Tuple *action_number_tuple = dict_find(iter, INDIGO_REMOTE_KEY_ACTION_NUMBER);
+        if (device_number_tuple) {
+            pending_fail(true, tuple_uint(device_number_tuple));
+        }
+        if (action_number_tuple) {
+            pending_fail(false, tuple_uint(action_number_tuple));
+        }
+    }
+    
+    if (command_queued_tuple) {
+        // The phone couldn't reach the Indigo Server, and will carry out the toggle, dim or execute once it can
+        Tuple *device_number_tuple = dict_find(iter, INDIGO_REMOTE_KEY_DEVICE_NUMBER);
+        Tuple *action_number_tuple = dict_find(iter, INDIGO_REMOTE_KEY_ACTION_NUMBER);
+        if (device_number_tuple) {
+            pending_queue(true, tuple_uint(device_number_tuple));
+        }
+        if (action_number_tuple) {
+            pending_queue(false, tuple_uint(action_number_tuple));
+        }
+    }
+    
+    if (could_not_connect_tuple) {
+        // A list restored from the snapshot is still worth showing, so this only ends a wait for a list we don't have
+        uint32_t lists = tuple_uint(could_not_connect_tuple);
+        if ((lists & COULD_NOT_CONNECT_DEVICES) && (gotDeviceCount == STATUS_LOADING)) {
+            gotDeviceCount = STATUS_COULD_NOT_CONNECT;
+        }
+        if ((lists & COULD_NOT_CONNECT_ACTIONS) && (gotActionCount == STATUS_LOADING)) {
+            gotActionCount = STATUS_COULD_NOT_CONNECT;
+        }
+        redraw_schedule(REDRAW_TOP);
+    }
+    
+    if (group_failed_tuple) {
+        // The devices' new state came in the same message as a device batch
+        Tuple *group_queued_tuple = dict_find(iter, INDIGO_REMOTE_KEY_GROUP_QUEUED);
+        group_settle(STATUS_LOADED, tuple_uint(group_failed_tuple), group_queued_tuple ? tuple_uint(group_queued_tuple) : 0);
+    }
+    
+    if (diagnostics_tuple) {
+        strncpy(phoneDiagnostics, diagnostics_tuple->value->cstring, MAX_PHONE_DIAGNOSTICS_LENGTH - 1);
+        phoneDiagnostics[MAX_PHONE_DIAGNOSTICS_LENGTH - 1] = '\0';
+        if (window_stack_get_top_window() == diagnostics_window) {
+            diagnostics_update_text();
         }
     }
     
     if (loading_tuple) {
         // Configuration changed, reset to initial loading state
+        pending_clear();
+        group_settle(STATUS_NONE, 0, 0);
         window_stack_pop_all(false /* Not animated */);
         window_stack_push(top_window, false /* Not animated */);
     
         deviceCount = 0;
         gotDeviceCount = STATUS_LOADING;
+        devicesPartial = false;
+        deviceSnapshotVersion = 0;
+        device_set_paged(false);
         actionCount = 0;
         gotActionCount = STATUS_LOADING;
+        actionSnapshotVersion = 0;
+        records_clear();
         
         layer_mark_dirty(menu_layer_get_layer(top_menu_layer));
     }
+    
+    if (ready_tuple) {
+        // The phone's script has just started, so it has yet to hear that we want the lists
+        phoneReady = true;
+        loading_retry();
+    }
+    
+    // Any message, a heartbeat included, shows the phone is still working on the lists
+    loading_heard();
+    
+    PROFILE_END(PROFILE_IN_RECEIVED);
+    if (device_count_complete_tuple) {
+        PROFILE_HEAP("devices synced");
+    }
+    if (action_count_complete_tuple) {
+        PROFILE_HEAP("actions synced");
+    }
+    if (device_count_complete_tuple || action_count_complete_tuple) {
+        PROFILE_LOG("sync");
+    }
 }
 
 static void in_dropped_handler(AppMessageResult reason, void *context) {
     APP_LOG(APP_LOG_LEVEL_DEBUG, "App Message Dropped!");
+    PROFILE_COUNT(messagesDropped);
+}
+
+static void command_queue_flush(void);
+static void command_retry_later(void);
+
+static void out_sent_handler(DictionaryIterator *sent, void *context) {
+    // Done with the command at the head of the queue, so send the next one
+    if (commandInFlight) {
+        commandInFlight = false;
+        pending_sent(&command_queue[commandQueueHead]);
+        commandQueueHead = (commandQueueHead + 1) % COMMAND_QUEUE_CAPACITY;
+        commandQueueLength--;
+    }
+    command_queue_flush();
 }
 
 static void out_failed_handler(DictionaryIterator *failed, AppMessageResult reason, void *context) {
     APP_LOG(APP_LOG_LEVEL_DEBUG, "App Message Failed to Send!");
+    PROFILE_COUNT(messagesFailed);
+    
+    if (commandInFlight) {
+        commandInFlight = false;
+        command_retry_later();
+    }
 }
 
 static void app_message_init(void) {
     // Register message handlers
     app_message_register_inbox_received(in_received_handler);
     app_message_register_inbox_dropped(in_dropped_handler);
+    app_message_register_outbox_sent(out_sent_handler);
     app_message_register_outbox_failed(out_failed_handler);
-    // Init buffers
-    app_message_open(app_message_inbox_size_maximum(), app_message_outbox_size_maximum());
+    // Init buffers; the phone packs as many records into each message as our inbox can hold
+    inboxSize = app_message_inbox_size_maximum();
+    if ((APP_MESSAGE_INBOX_SIZE > 0) && (APP_MESSAGE_INBOX_SIZE < inboxSize)) {
+        inboxSize = APP_MESSAGE_INBOX_SIZE;
+    }
+    outboxSize = app_message_outbox_size_maximum();
+    if ((APP_MESSAGE_OUTBOX_SIZE > 0) && (APP_MESSAGE_OUTBOX_SIZE < outboxSize)) {
+        outboxSize = APP_MESSAGE_OUTBOX_SIZE;
+    }
+    app_message_open(inboxSize, outboxSize);
+    PROFILE_HEAP("app message open");
 }
 
-// Request information about the devices and actions known to the Indigo Server
-static void devices_and_actions_msg(void) {
-    Tuplet get_devices_and_actions_tuple = TupletInteger(INDIGO_REMOTE_KEY_GET_DEVICES_AND_ACTIONS, 1);
-    
-    DictionaryIterator *iter;
-    app_message_outbox_begin(&iter);
-    
-    if (iter == NULL) {
-        return;
+// Which list is on screen and the range of its rows that may be. The selected row can be anywhere on screen,
+// so the range runs from a screen above it to a screen below. From the main menu it's the first screen of
+// the list that's selected, since that's what the user will see next.
+static void visible_rows(uint8_t *list, uint16_t *start, uint16_t *count) {
+    Window *window = window_stack_get_top_window();
+    MenuLayer *menu_layer = NULL;
+    if ((window == devices_window) || (window == dim_window)) {
+        *list = VISIBLE_LIST_DEVICES;
+        menu_layer = devices_menu_layer;
+    }
+    else if (window == actions_window) {
+        *list = VISIBLE_LIST_ACTIONS;
+        menu_layer = actions_menu_layer;
+    }
+    else {
+        *list = (top_menu_layer && (menu_layer_get_selected_index(top_menu_layer).row == 1))? VISIBLE_LIST_ACTIONS : VISIBLE_LIST_DEVICES;
     }
     
-    dict_write_tuplet(iter, &get_devices_and_actions_tuple);
-    dict_write_end(iter);
-    
-    app_message_outbox_send();
+    uint16_t selected = menu_layer ? menu_layer_get_selected_index(menu_layer).row : 0;
+    *start = (selected >= SCREEN_ROWS - 1)? selected - (SCREEN_ROWS - 1) : 0;
+    *count = selected - *start + SCREEN_ROWS;
 }
 
-// Request to toggle on/off the specified device
-static void toggle_msg(uint8_t deviceNumber) {
-    Tuplet device_toggle_on_off_tuple = TupletInteger(INDIGO_REMOTE_KEY_DEVICE_TOGGLE_ON_OFF, 1);
-    Tuplet device_number_tuple = TupletInteger(INDIGO_REMOTE_KEY_DEVICE_NUMBER, deviceNumber);
-    
-    DictionaryIterator *iter;
-    app_message_outbox_begin(&iter);
+static void command_write(DictionaryIterator *iter, const Command *command) {
+    uint8_t visibleList;
+    uint16_t visibleStart, visibleCount;
+    switch (command->type) {
+        case COMMAND_GET_DEVICES_AND_ACTIONS:
+            visible_rows(&visibleList, &visibleStart, &visibleCount);
+            dict_write_uint8(iter, INDIGO_REMOTE_KEY_GET_DEVICES_AND_ACTIONS, 1);
+            dict_write_uint32(iter, INDIGO_REMOTE_KEY_INBOX_SIZE, inboxSize);
+            dict_write_uint32(iter, INDIGO_REMOTE_KEY_DEVICE_SNAPSHOT_VERSION, deviceSnapshotVersion);
+            dict_write_uint32(iter, INDIGO_REMOTE_KEY_ACTION_SNAPSHOT_VERSION, actionSnapshotVersion);
+            dict_write_uint16(iter, INDIGO_REMOTE_KEY_MAX_DEVICES, MAX_NUMBER_OF_DEVICES);
+            dict_write_uint16(iter, INDIGO_REMOTE_KEY_DEVICE_WINDOW_SIZE, DEVICE_WINDOW_SIZE);
+            dict_write_uint8(iter, INDIGO_REMOTE_KEY_VISIBLE_LIST, visibleList);
+            dict_write_uint16(iter, INDIGO_REMOTE_KEY_VISIBLE_ROW, visibleStart);
+            dict_write_uint16(iter, INDIGO_REMOTE_KEY_VISIBLE_ROW_COUNT, visibleCount);
+            break;
+        case COMMAND_TOGGLE:
+            dict_write_uint8(iter, INDIGO_REMOTE_KEY_DEVICE_TOGGLE_ON_OFF, 1);
+            dict_write_uint16(iter, INDIGO_REMOTE_KEY_DEVICE_NUMBER, command->number);
+            // Ask for the state we're showing, so toggling twice in quick succession leaves things as they were
+            if (command->value != STATUS_TOGGLING) {
+                dict_write_uint8(iter, INDIGO_REMOTE_KEY_DEVICE_ON, command->value == STATUS_ON);
+            }
+            if (tracing) {
+                dict_write_uint8(iter, INDIGO_REMOTE_KEY_TRACE, 1);
+            }
+            break;
+        case COMMAND_EXECUTE:
+            dict_write_uint8(iter, INDIGO_REMOTE_KEY_ACTION_EXECUTE, 1);
+            dict_write_uint16(iter, INDIGO_REMOTE_KEY_ACTION_NUMBER, command->number);
+            if (tracing) {
+                dict_write_uint8(iter, INDIGO_REMOTE_KEY_TRACE, 1);
+            }
+            break;
+        case COMMAND_DIM:
+            dict_write_uint8(iter, INDIGO_REMOTE_KEY_DEVICE_DIM, 1);
+            dict_write_uint16(iter, INDIGO_REMOTE_KEY_DEVICE_NUMBER, command->number);
+            dict_write_uint8(iter, INDIGO_REMOTE_KEY_DEVICE_DIM_LEVEL, command->value);
+            if (tracing) {
+                dict_write_uint8(iter, INDIGO_REMOTE_KEY_TRACE, 1);
+            }
+            break;
+        case COMMAND_DEVICES_VISIBLE:
+            dict_write_uint8(iter, INDIGO_REMOTE_KEY_DEVICES_VISIBLE, command->value);
+            break;
+        case COMMAND_DEVICE_WINDOW:
+            dict_write_uint16(iter, INDIGO_REMOTE_KEY_DEVICE_WINDOW_START, command->value);
+            break;
+        case COMMAND_DIAGNOSTICS:
+            dict_write_uint8(iter, INDIGO_REMOTE_KEY_DIAGNOSTICS, 1);
+            break;
+        case COMMAND_GROUP:
+            // Without a list of device numbers (INDIGO_REMOTE_KEY_GROUP_DEVICES), the group is every device
+            dict_write_uint8(iter, INDIGO_REMOTE_KEY_GROUP_ON_OFF, command->value);
+            if (tracing) {
+                dict_write_uint8(iter, INDIGO_REMOTE_KEY_TRACE, 1);
+            }
+            break;
+    }
+}
+
+// Show on the command's row that it didn't get through, so the user can try again
+static void command_failed(const Command *command) {
+    switch (command->type) {
+        case COMMAND_TOGGLE:
+        case COMMAND_DIM:
+            pending_fail(true, command->number);
+            break;
+        case COMMAND_EXECUTE:
+            pending_fail(false, command->number);
+            break;
+        case COMMAND_GET_DEVICES_AND_ACTIONS:
+            // loading_timeout_callback reports that we could not connect
+            break;
+        case COMMAND_GROUP:
+            group_settle(STATUS_FAILED, 0, 0);
+            break;
+        case COMMAND_DEVICES_VISIBLE:
+        case COMMAND_DEVICE_WINDOW:
+        case COMMAND_DIAGNOSTICS:
+            break;
+    }
+}
+
+static void command_retry_timer_callback(void *data) {
+    command_retry_timer = NULL;
+    command_queue_flush();
+}
+
+// The command at the head of the queue didn't go out; try it again after a while, unless it has used up
+// its attempts or a newer command for the same row is waiting behind it
+static void command_retry_later(void) {
+    Command *command = &command_queue[commandQueueHead];
+    bool superseded = false;
+    for (uint8_t i = 1; i < commandQueueLength; i++) {
+        Command *queued = &command_queue[(commandQueueHead + i) % COMMAND_QUEUE_CAPACITY];
+        if ((queued->type == command->type) && (queued->number == command->number)) {
+            superseded = true;
+            break;
+        }
+    }
     
-    if (iter == NULL) {
+    command->attempts++;
+    if (superseded || (command->attempts >= COMMAND_MAX_ATTEMPTS)) {
+        if (!superseded) {
+            APP_LOG(APP_LOG_LEVEL_DEBUG, "Giving up on command after %d attempts", command->attempts);
+            PROFILE_COUNT(commandsAbandoned);
+            command_failed(command);
+        }
+        commandQueueHead = (commandQueueHead + 1) % COMMAND_QUEUE_CAPACITY;
+        commandQueueLength--;
+        command_queue_flush();
         return;
     }
     
-    dict_write_tuplet(iter, &device_toggle_on_off_tuple);
-    dict_write_tuplet(iter, &device_number_tuple);
-    dict_write_end(iter);
-    
-    app_message_outbox_send();
+    PROFILE_COUNT(commandsRetried);
+    if (command_retry_timer == NULL) {
+        command_retry_timer = app_timer_register(COMMAND_RETRY_DELAY_MS << (command->attempts - 1), command_retry_timer_callback, NULL);
+    }
 }
 
-// Request to execute the specified action
-static void execute_msg(uint8_t actionNumber) {
-    Tuplet action_execute_tuple = TupletInteger(INDIGO_REMOTE_KEY_ACTION_EXECUTE, 1);
-    Tuplet action_number_tuple = TupletInteger(INDIGO_REMOTE_KEY_ACTION_NUMBER, actionNumber);
+// Send the command at the head of the queue, if the outbox is free and we're not waiting to retry
+static void command_queue_flush(void) {
+    if (commandInFlight || (command_retry_timer != NULL) || (commandQueueLength == 0)) {
+        return;
+    }
     
     DictionaryIterator *iter;
-    app_message_outbox_begin(&iter);
-    
-    if (iter == NULL) {
+    if ((app_message_outbox_begin(&iter) != APP_MSG_OK) || (iter == NULL)) {
+        command_retry_later();
         return;
     }
     
-    dict_write_tuplet(iter, &action_execute_tuple);
-    dict_write_tuplet(iter, &action_number_tuple);
+    command_write(iter, &command_queue[commandQueueHead]);
     dict_write_end(iter);
     
-    app_message_outbox_send();
+    if (app_message_outbox_send() != APP_MSG_OK) {
+        command_retry_later();
+        return;
+    }
+    commandInFlight = true;
+    PROFILE_COUNT(messagesSent);
 }
 
-// Request to execute the specified action
-static void dim_msg(uint8_t deviceNumber) {
-    Tuplet device_dim_tuple = TupletInteger(INDIGO_REMOTE_KEY_DEVICE_DIM, 1);
-    Tuplet device_number_tuple = TupletInteger(INDIGO_REMOTE_KEY_DEVICE_NUMBER, deviceNumber);
-    Tuplet device_dim_level_tuple = TupletInteger(INDIGO_REMOTE_KEY_DEVICE_DIM_LEVEL, dimLevel);
-    
-    DictionaryIterator *iter;
-    app_message_outbox_begin(&iter);
+// Queue a command for the phone. A command for a row that already has one of the same kind waiting
+// replaces it rather than queuing behind it, so e.g. a dim only ever goes out with the latest level
+// and holding the buttons down never fills the queue.
+static void command_enqueue(CommandType type, uint16_t number, uint16_t value) {
+    // The head is left alone while in flight, since what it sends can no longer change
+    for (uint8_t i = commandInFlight? 1 : 0; i < commandQueueLength; i++) {
+        Command *queued = &command_queue[(commandQueueHead + i) % COMMAND_QUEUE_CAPACITY];
+        if ((queued->type == type) && (queued->number == number)) {
+            queued->value = value;
+            queued->attempts = 0;
+            PROFILE_COUNT(commandsCollapsed);
+            command_queue_flush();
+            return;
+        }
+    }
     
-    if (iter == NULL) {
+    Command command = { .type = type, .attempts = 0, .number = number, .value = value };
+    if (commandQueueLength == COMMAND_QUEUE_CAPACITY) {
+        APP_LOG(APP_LOG_LEVEL_DEBUG, "Command queue full");
+        PROFILE_COUNT(commandsAbandoned);
+        command_failed(&command);
         return;
     }
-    
-    dict_write_tuplet(iter, &device_dim_tuple);
-    dict_write_tuplet(iter, &device_number_tuple);
-    dict_write_tuplet(iter, &device_dim_level_tuple);
-    dict_write_end(iter);
-    
-    app_message_outbox_send();
+    command_queue[(commandQueueHead + commandQueueLength) % COMMAND_QUEUE_CAPACITY] = command;
+    commandQueueLength++;
+    command_queue_flush();
+}
+
+// Request information about the devices and actions known to the Indigo Server
+static void devices_and_actions_msg(void) {
+    command_enqueue(COMMAND_GET_DEVICES_AND_ACTIONS, 0, 0);
+}
+
+// Request to switch the specified device on or off (STATUS_ON or STATUS_OFF), or just to toggle it (STATUS_TOGGLING)
+static void toggle_msg(uint16_t deviceNumber, uint8_t on) {
+    command_enqueue(COMMAND_TOGGLE, deviceNumber, on);
+}
+
+// Request to execute the specified action
+static void execute_msg(uint16_t actionNumber) {
+    command_enqueue(COMMAND_EXECUTE, actionNumber, 0);
+}
+
+// Request to dim the specified device to the current dim level. Dimming streams the level to the device
+// as the buttons are held; while the outbox is busy only the latest level waits to go out, so the final
+// level always gets there while intermediate levels are skipped when the link can't keep up.
+static void dim_msg(uint16_t deviceNumber) {
+    command_enqueue(COMMAND_DIM, deviceNumber, dimLevel);
+}
+
+// Tell the phone whether the devices list is on screen, so it can poll device state more often while it is
+static void devices_visible_msg(bool visible) {
+    command_enqueue(COMMAND_DEVICES_VISIBLE, 0, visible);
+}
+
+// Tell the phone where the window of a paged devices list now starts, so it sends the rows that came into it;
+// only the latest window matters, so a quick scroll sends one request
+static void device_window_msg(uint16_t start) {
+    command_enqueue(COMMAND_DEVICE_WINDOW, 0, start);
+}
+
+// Ask the phone for its latency percentiles, which also has it log its histograms
+static void diagnostics_msg(void) {
+    command_enqueue(COMMAND_DIAGNOSTICS, 0, 0);
+}
+
+// Request to switch every device on or off
+static void group_msg(bool on) {
+    command_enqueue(COMMAND_GROUP, 0, on);
 }
 
 
@@ -389,6 +2008,33 @@ static int16_t actions_menu_get_header_height_callback(MenuLayer *menu_layer, ui
     return MENU_CELL_BASIC_HEADER_HEIGHT;
 }
 
+static void top_menu_draw_group_row(GContext* ctx, const Layer *cell_layer, bool on) {
+    // Room for the longest, "65535 queued, 65535 couldn't switch"
+    static char subtitle[40];
+    if ((groupStatus == STATUS_NONE) || (groupOn != on)) {
+        snprintf(subtitle, sizeof(subtitle), "Switch every device %s", on ? "on" : "off");
+    }
+    else if (groupStatus == STATUS_TOGGLING) {
+        snprintf(subtitle, sizeof(subtitle), "Switching...");
+    }
+    else if (groupStatus == STATUS_FAILED) {
+        snprintf(subtitle, sizeof(subtitle), "Failed, select to retry");
+    }
+    else if ((groupQueuedCount > 0) && (groupFailedCount > 0)) {
+        snprintf(subtitle, sizeof(subtitle), "%u queued, %u couldn't switch", groupQueuedCount, groupFailedCount);
+    }
+    else if (groupQueuedCount > 0) {
+        snprintf(subtitle, sizeof(subtitle), "%u queued until reachable", groupQueuedCount);
+    }
+    else if (groupFailedCount > 0) {
+        snprintf(subtitle, sizeof(subtitle), "%u couldn't switch", groupFailedCount);
+    }
+    else {
+        snprintf(subtitle, sizeof(subtitle), "Done");
+    }
+    menu_cell_basic_draw(ctx, cell_layer, on ? "All on" : "All off", subtitle, NULL);
+}
+
 // Here we capture when a user selects a menu item
 static void top_menu_select_callback(MenuLayer *menu_layer, MenuIndex *cell_index, void *data) {
     // Use the row to specify which item will receive the select action
@@ -398,39 +2044,106 @@ static void top_menu_select_callback(MenuLayer *menu_layer, MenuIndex *cell_inde
                 // Go to the devices window
                 window_stack_push(devices_window, true /* Animated */);
             }
+            else if (gotDeviceCount == STATUS_COULD_NOT_CONNECT) {
+                loading_retry();
+            }
             break;
         case 1:
             if (gotActionCount == STATUS_LOADED) {
                 // Go to the actions window
                 window_stack_push(actions_window, true /* Animated */);
             }
+            else if (gotActionCount == STATUS_COULD_NOT_CONNECT) {
+                loading_retry();
+            }
+            break;
+        case 2:
+        case 3:
+            if ((gotDeviceCount == STATUS_LOADED) && (deviceCount > 0)) {
+                groupOn = (cell_index->row == 2);
+                groupStatus = STATUS_TOGGLING;
+                group_msg(groupOn);
+                if (group_timeout_timer) {
+                    app_timer_reschedule(group_timeout_timer, GROUP_TIMEOUT_MS);
+                }
+                else {
+                    group_timeout_timer = app_timer_register(GROUP_TIMEOUT_MS, group_timeout_callback, NULL);
+                }
+                layer_mark_dirty(menu_layer_get_layer(top_menu_layer));
+            }
             break;
     }
 }
 
+// A long press anywhere on the main menu opens the diagnostics window
+static void top_menu_select_long_click_callback(MenuLayer *menu_layer, MenuIndex *cell_index, void *data) {
+    window_stack_push(diagnostics_window, true /* Animated */);
+}
+
 // Here we capture when a user selects a menu item
 static void devices_menu_select_callback(MenuLayer *menu_layer, MenuIndex *cell_index, void *data) {
-    if (device_data_list[cell_index->row].on != STATUS_TOGGLING) {
-        toggle_msg(cell_index->row);
-        device_data_list[cell_index->row].on = STATUS_TOGGLING;
+    PROFILE_BEGIN();
+    
+    DeviceData *device = device_data(cell_index->row);
+    uint8_t on = device_state(cell_index->row);
+    if (device && ((on == STATUS_ON) || (on == STATUS_OFF))) {
+        // Show the new state straight away; it's rolled back if the phone doesn't confirm it
+        pending_begin(true, cell_index->row, on);
+        device->on = (on == STATUS_ON)? STATUS_OFF : STATUS_ON;
+        deviceSnapshotVersion = 0;
+        toggle_msg(cell_index->row, device->on);
+        layer_mark_dirty(menu_layer_get_layer(devices_menu_layer));
+    }
+    else if (device && (on != STATUS_TOGGLING)) {
+        // We don't know its state yet, so all we can do is toggle it
+        pending_begin(true, cell_index->row, on);
+        device->on = STATUS_TOGGLING;
+        toggle_msg(cell_index->row, STATUS_TOGGLING);
         layer_mark_dirty(menu_layer_get_layer(devices_menu_layer));
     }
+    
+    PROFILE_END(PROFILE_SELECT);
+}
+
+// Keep the window of a paged list centred on the page of the selected row
+static void devices_menu_selection_changed_callback(MenuLayer *menu_layer, MenuIndex new_index, MenuIndex old_index, void *data) {
+    if (!devicesPaged) {
+        return;
+    }
+    int32_t pageCount = (deviceCount + DEVICE_PAGE_SIZE - 1) / DEVICE_PAGE_SIZE;
+    int32_t firstPage = (new_index.row / DEVICE_PAGE_SIZE) - (DEVICE_WINDOW_PAGES / 2);
+    if (firstPage > pageCount - DEVICE_WINDOW_PAGES) {
+        firstPage = pageCount - DEVICE_WINDOW_PAGES;
+    }
+    if (firstPage < 0) {
+        firstPage = 0;
+    }
+    if (firstPage * DEVICE_PAGE_SIZE != deviceWindowStart) {
+        device_window_move(firstPage * DEVICE_PAGE_SIZE);
+        device_window_msg(deviceWindowStart);
+    }
 }
 
 static void devices_menu_select_long_click_callback(MenuLayer *menu_layer, MenuIndex *cell_index, void *data) {
     // Go to the dim window
     selectedDeviceNumber = cell_index->row;
-    strncpy(selectedDeviceName, device_data_list[selectedDeviceNumber].name, MAX_DEVICE_NAME_LENGTH);
+    strncpy(selectedDeviceName, device_name(selectedDeviceNumber), MAX_DEVICE_NAME_LENGTH - 1);
+    selectedDeviceName[MAX_DEVICE_NAME_LENGTH - 1] = '\0';
     window_stack_push(dim_window, true /* Animated */);
 }
 
 // Here we capture when a user selects a menu item
 static void actions_menu_select_callback(MenuLayer *menu_layer, MenuIndex *cell_index, void *data) {
+    PROFILE_BEGIN();
+    
     if (action_data_list[cell_index->row].status != STATUS_EXECUTING) {
-        execute_msg(cell_index->row);
+        pending_begin(false, cell_index->row, STATUS_NONE);
         action_data_list[cell_index->row].status = STATUS_EXECUTING;
+        execute_msg(cell_index->row);
         layer_mark_dirty(menu_layer_get_layer(actions_menu_layer));
     }
+    
+    PROFILE_END(PROFILE_SELECT);
 }
 
 // Here we draw what header is
@@ -469,63 +2182,86 @@ static void top_menu_draw_row_callback(GContext* ctx, const Layer *cell_layer, M
             switch (cell_index->row) {
                 case 0:
                     // This is a basic menu item with a title and subtitle
-                    menu_cell_basic_draw(ctx, cell_layer, "Devices", (gotDeviceCount == STATUS_LOADING)? "Loading...":(gotDeviceCount == STATUS_LOADED)?"Control devices":"Could not connect", device_menu_item_icon);
+                    menu_cell_basic_draw(ctx, cell_layer, "Devices", (gotDeviceCount == STATUS_LOADING)? "Loading...":(gotDeviceCount != STATUS_LOADED)?"Could not connect, select to retry":devicesPartial?"Some devices missing":"Control devices", device_menu_item_icon);
                     break;
                     
                 case 1:
                     // This is a basic menu item with a title and subtitle
-                    menu_cell_basic_draw(ctx, cell_layer, "Actions", (gotActionCount == STATUS_LOADING)? "Loading...":(gotActionCount == STATUS_LOADED)?"Execute actions":"Could not connect", action_menu_item_icon);
+                    menu_cell_basic_draw(ctx, cell_layer, "Actions", (gotActionCount == STATUS_LOADING)? "Loading...":(gotActionCount == STATUS_LOADED)?"Execute actions":"Could not connect, select to retry", action_menu_item_icon);
+                    break;
+                    
+                case 2:
+                case 3:
+                    top_menu_draw_group_row(ctx, cell_layer, cell_index->row == 2);
                     break;
             }
             break;
     }
 }
 
+// Row subtitles by device and action status; "" for any status without one
+static const char *const device_status_texts[] = {
+    [STATUS_OFF] = "Off",
+    [STATUS_ON] = "On",
+    [STATUS_GETTING_STATE] = "Getting current state...",
+    [STATUS_TOGGLING] = "Toggling...",
+    [STATUS_FAILED] = "Failed, select to retry",
+    [STATUS_FAILED_OFF] = "Off (couldn't switch)",
+    [STATUS_FAILED_ON] = "On (couldn't switch)",
+    [STATUS_QUEUED] = "Queued, server unreachable",
+    [STATUS_QUEUED_OFF] = "Off (queued)",
+    [STATUS_QUEUED_ON] = "On (queued)",
+    [STATUS_STALE_OFF] = "Off (last known)",
+    [STATUS_STALE_ON] = "On (last known)"
+};
+
+static const char *const action_status_texts[] = {
+    [STATUS_EXECUTING] = "Executing...",
+    [STATUS_FAILED] = "Failed, select to retry",
+    [STATUS_QUEUED] = "Queued, server unreachable"
+};
+
+static const char *status_text(const char *const *texts, size_t count, uint8_t status) {
+    return ((status < count) && texts[status])? texts[status] : "";
+}
+
 // This is the menu item draw callback where you specify what each item should look like
 static void devices_menu_draw_row_callback(GContext* ctx, const Layer *cell_layer, MenuIndex *cell_index, void *data) {
+    PROFILE_BEGIN();
+    
     // Determine which section we're going to draw in
     switch (cell_index->section) {
         case 0:
             if (cell_index->row < deviceCount) {
-                menu_cell_basic_draw(ctx, cell_layer, device_data_list[cell_index->row].name,
-                    (device_data_list[cell_index->row].on == STATUS_GETTING_STATE)? "Getting current state...":
-                    (device_data_list[cell_index->row].on == STATUS_TOGGLING)? "Toggling...":
-                    (device_data_list[cell_index->row].on)? "On" : "Off", NULL);
+                // Rows outside the window of a paged list show as loading until the phone sends them
+                DeviceData *device = device_data(cell_index->row);
+                uint8_t on = device ? device->on : STATUS_GETTING_STATE;
+                trace_render_end(true, cell_index->row);
+                menu_cell_basic_draw(ctx, cell_layer, device_name(cell_index->row),
+                    status_text(device_status_texts, sizeof(device_status_texts) / sizeof(device_status_texts[0]), on), NULL);
             }
             break;
     }
+    
+    PROFILE_END(PROFILE_DRAW_ROW);
 }
 
 // This is the menu item draw callback where you specify what each item should look like
 static void actions_menu_draw_row_callback(GContext* ctx, const Layer *cell_layer, MenuIndex *cell_index, void *data) {
+    PROFILE_BEGIN();
+    
     // Determine which section we're going to draw in
     switch (cell_index->section) {
         case 0:
-            if (cell_index->row < deviceCount) {
-                menu_cell_basic_draw(ctx, cell_layer, action_data_list[cell_index->row].name,
-                                     (action_data_list[cell_index->row].status == STATUS_EXECUTING)? "Executing...":"", NULL);
+            if (cell_index->row < actionCount) {
+                trace_render_end(false, cell_index->row);
+                menu_cell_basic_draw(ctx, cell_layer, action_name(cell_index->row),
+                    status_text(action_status_texts, sizeof(action_status_texts) / sizeof(action_status_texts[0]), action_data_list[cell_index->row].status), NULL);
             }
             break;
     }
-}
-
-static void loading_timer_callback(void *data) {
-    devices_and_actions_msg();
-}
-
-static void loading_timeout_callback(void *data) {
-    if (gotDeviceCount == STATUS_LOADING) {
-        gotDeviceCount = STATUS_COULD_NOT_CONNECT;
-        if (window_stack_get_top_window() == top_window) {
-            layer_mark_dirty(menu_layer_get_layer(top_menu_layer));
-        }
-    }
-    if (gotActionCount == STATUS_LOADING) {
-        gotActionCount = STATUS_COULD_NOT_CONNECT;
-        if (window_stack_get_top_window() == top_window) {
-            layer_mark_dirty(menu_layer_get_layer(top_menu_layer));
-        }
-    }
+    
+    PROFILE_END(PROFILE_DRAW_ROW);
 }
 
 // This initializes the menu upon window load
@@ -551,7 +2287,8 @@ static void top_window_load(Window *window) {
         .get_header_height = top_menu_get_header_height_callback,
         .draw_header = top_menu_draw_header_callback,
         .draw_row = top_menu_draw_row_callback,
-        .select_click = top_menu_select_callback
+        .select_click = top_menu_select_callback,
+        .select_long_click = top_menu_select_long_click_callback
     });
 
     // Bind the menu layer's click config provider to the window for interactivity
@@ -560,12 +2297,17 @@ static void top_window_load(Window *window) {
     // Add it to the window for display
     layer_add_child(window_layer, menu_layer_get_layer(top_menu_layer));
     
-    // Fire off getting the devices info
-    app_timer_register(250, loading_timer_callback, NULL);
-    
-    // Fire off a timeout handler
-    app_timer_register(10000, loading_timeout_callback, NULL);
-
+    // Start waiting for the lists, replacing any wait left from before the configuration changed; they're
+    // asked for now if the phone is ready, otherwise as soon as it says it is
+    if (loading_timeout_timer) {
+        app_timer_cancel(loading_timeout_timer);
+        loading_timeout_timer = NULL;
+    }
+    loading_wait();
+    if (phoneReady) {
+        devices_and_actions_msg();
+    }
+    PROFILE_HEAP("top load");
 }
 
 static void top_window_unload(Window *window) {
@@ -575,6 +2317,7 @@ static void top_window_unload(Window *window) {
     // Cleanup the menu icons
     gbitmap_destroy(device_menu_item_icon);
     gbitmap_destroy(action_menu_item_icon);
+    PROFILE_HEAP("top unload");
 }
 
 // This initializes the menu upon window load
@@ -596,7 +2339,8 @@ static void devices_window_load(Window *window) {
         .draw_header = devices_menu_draw_header_callback,
         .draw_row = devices_menu_draw_row_callback,
         .select_click = devices_menu_select_callback,
-        .select_long_click = devices_menu_select_long_click_callback
+        .select_long_click = devices_menu_select_long_click_callback,
+        .selection_changed = devices_menu_selection_changed_callback
     });
 
     // Bind the menu layer's click config provider to the window for interactivity
@@ -604,11 +2348,21 @@ static void devices_window_load(Window *window) {
     
     // Add it to the window for display
     layer_add_child(window_layer, menu_layer_get_layer(devices_menu_layer));
+    PROFILE_HEAP("devices load");
+}
+
+static void devices_window_appear(Window *window) {
+    devices_visible_msg(true);
+}
+
+static void devices_window_disappear(Window *window) {
+    devices_visible_msg(false);
 }
 
 static void devices_window_unload(Window *window) {
     // Destroy the menu layer
     menu_layer_destroy(devices_menu_layer);
+    PROFILE_HEAP("devices unload");
 }
 
 // This initializes the menu upon window load
@@ -637,11 +2391,13 @@ static void actions_window_load(Window *window) {
     
     // Add it to the window for display
     layer_add_child(window_layer, menu_layer_get_layer(actions_menu_layer));
+    PROFILE_HEAP("actions load");
 }
 
 static void actions_window_unload(Window *window) {
     // Destroy the menu layer
     menu_layer_destroy(actions_menu_layer);
+    PROFILE_HEAP("actions unload");
 }
 
 static void dim_update_text() {
@@ -650,20 +2406,31 @@ static void dim_update_text() {
     text_layer_set_text(dim_body_text_layer, body_text);
 }
 
+// Send the dim level; if the phone doesn't confirm it, the device's row goes back to previousOn
+static void dim_send(uint8_t previousOn) {
+    pending_begin(true, selectedDeviceNumber, previousOn);
+    dim_update_text();
+    dim_msg(selectedDeviceNumber);
+}
+
 static void dim_increment_click_handler(ClickRecognizerRef recognizer, void *context) {
     if (dimLevel >= MAX_DIM) {
         return;
     }
     
+    uint8_t previousOn = device_state(selectedDeviceNumber);
     dimLevel++;
     
-    device_data_list[selectedDeviceNumber].on = STATUS_ON;
+    if (device_data(selectedDeviceNumber)) {
+        device_data(selectedDeviceNumber)->on = STATUS_ON;
+    }
+    deviceSnapshotVersion = 0;
     
-    dim_update_text();
+    dim_send(previousOn);
 }
 
 static void dim_select_single_click_handler(ClickRecognizerRef recognizer, void *context) {
-    dim_msg(selectedDeviceNumber);
+    dim_send(device_state(selectedDeviceNumber));
 }
 
 static void dim_decrement_click_handler(ClickRecognizerRef recognizer, void *context) {
@@ -671,13 +2438,17 @@ static void dim_decrement_click_handler(ClickRecognizerRef recognizer, void *con
         return;
     }
     
+    uint8_t previousOn = device_state(selectedDeviceNumber);
     dimLevel--;
     
     if (dimLevel <= MIN_DIM) {
-        device_data_list[selectedDeviceNumber].on = STATUS_OFF;
+        if (device_data(selectedDeviceNumber)) {
+            device_data(selectedDeviceNumber)->on = STATUS_OFF;
+        }
+        deviceSnapshotVersion = 0;
     }
     
-    dim_update_text();
+    dim_send(previousOn);
 }
 
 static void dim_click_config_provider(void *context) {
@@ -725,6 +2496,7 @@ static void dim_window_load(Window *window) {
     layer_add_child(window_layer, text_layer_get_layer(dim_label_text_layer));
     
     dim_update_text();
+    PROFILE_HEAP("dim load");
 }
 
 static void dim_window_unload(Window *window) {
@@ -735,6 +2507,29 @@ static void dim_window_unload(Window *window) {
     gbitmap_destroy(action_icon_plus);
     gbitmap_destroy(action_icon_select);
     gbitmap_destroy(action_icon_minus);
+    PROFILE_HEAP("dim unload");
+}
+
+static void diagnostics_window_load(Window *window) {
+    Layer *window_layer = window_get_root_layer(window);
+    GRect bounds = layer_get_frame(window_layer);
+    
+    diagnostics_text_layer = text_layer_create(GRect(4, 0, bounds.size.w - 8, bounds.size.h));
+    text_layer_set_font(diagnostics_text_layer, fonts_get_system_font(FONT_KEY_GOTHIC_18));
+    layer_add_child(window_layer, text_layer_get_layer(diagnostics_text_layer));
+    PROFILE_HEAP("diagnostics load");
+}
+
+static void diagnostics_window_appear(Window *window) {
+    // Time everything from now on, and get the phone's side of it
+    tracing = true;
+    diagnostics_update_text();
+    diagnostics_msg();
+}
+
+static void diagnostics_window_unload(Window *window) {
+    text_layer_destroy(diagnostics_text_layer);
+    PROFILE_HEAP("diagnostics unload");
 }
 
 static void init(void) {
@@ -742,6 +2537,9 @@ static void init(void) {
     devices_window = window_create();
     actions_window = window_create();
     dim_window = window_create();
+    diagnostics_window = window_create();
+    snapshot_restore();
+    loading_gaps_restore();
     app_message_init();
     
     window_set_window_handlers(top_window, (WindowHandlers) {
@@ -750,6 +2548,8 @@ static void init(void) {
     });
     window_set_window_handlers(devices_window, (WindowHandlers) {
         .load = devices_window_load,
+        .appear = devices_window_appear,
+        .disappear = devices_window_disappear,
         .unload = devices_window_unload,
     });
     window_set_window_handlers(actions_window, (WindowHandlers) {
@@ -760,11 +2560,20 @@ static void init(void) {
         .load = dim_window_load,
         .unload = dim_window_unload,
     });
+    window_set_window_handlers(diagnostics_window, (WindowHandlers) {
+        .load = diagnostics_window_load,
+        .appear = diagnostics_window_appear,
+        .unload = diagnostics_window_unload,
+    });
     
     window_stack_push(top_window, true /* Animated */);
 }
 
 static void deinit(void) {
+    PROFILE_LOG("exit");
+    snapshot_save();
+    records_destroy();
+    window_destroy(diagnostics_window);
     window_destroy(dim_window);
     window_destroy(actions_window);
     window_destroy(devices_window);
@@ -775,4 +2584,5 @@ int main(void) {
     init();
     app_event_loop();
     deinit();
+    return 0;
 }
\ No newline at end of file
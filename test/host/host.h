@@ -0,0 +1,69 @@
+// Driving the app on the host: messages from the phone, the outbox, the clock, buttons and the screen.
+// Everything happens on the caller's thread, and after each event the host draws whatever it left dirty,
+// as the watch would on its next frame.
+
+#pragma once
+
+#include "pebble.h"
+
+// What the watch gives an Aplite app: 24 KB of heap, and the SDK 2 AppMessage inbox and outbox limits
+#define HOST_HEAP_SIZE 24576
+#define HOST_INBOX_SIZE_MAXIMUM 2026
+#define HOST_OUTBOX_SIZE_MAXIMUM 656
+
+// The callbacks into the app that are timed
+typedef enum {
+    HOST_IN_RECEIVED,
+    HOST_DRAW_ROW,
+    HOST_SELECT,
+    HOST_HANDLER_COUNT
+} HostHandler;
+
+typedef struct {
+    uint32_t calls;
+    uint64_t totalNs;
+    uint64_t maxNs;
+} HostHandlerStats;
+
+typedef struct {
+    HostHandlerStats handlers[HOST_HANDLER_COUNT];
+    uint32_t messagesReceived; // From the phone
+    uint32_t messagesSent; // To the phone, whether or not they got there
+    uint32_t frames; // Times the screen was drawn with anything on it dirty
+    uint32_t rowsDrawn;
+    size_t heapUsed;
+    size_t peakHeapUsed;
+} HostStats;
+
+extern HostStats host_stats;
+extern const char *host_handler_names[HOST_HANDLER_COUNT];
+extern bool host_verbose; // Print the app's log
+
+// Start a message from the phone, to be filled in with the dict_write_*() functions, then hand it to the
+// app's inbox handler
+DictionaryIterator *host_message_begin(void);
+void host_message_deliver(void);
+
+// The message the app has in its outbox, or NULL if it's free; finishing it calls the app's sent or failed
+// handler, which may send the next
+DictionaryIterator *host_outbox(void);
+void host_outbox_finish(bool delivered);
+
+// Milliseconds since the app started; advancing fires every timer due on the way, in order
+uint32_t host_now(void);
+void host_advance(uint32_t ms);
+
+// Buttons, on whichever window is on top: select and long select act on its menu's selected row, scrolling
+// moves the selection (as holding up or down would), and back pops the window
+void host_select(void);
+void host_long_select(void);
+void host_scroll_to(uint16_t row);
+void host_back(void);
+void host_button(ButtonId button);
+
+// Draw the top window if anything on it is dirty
+void host_render(void);
+
+// The title and subtitle of the cell drawn last
+extern char host_last_title[128];
+extern char host_last_subtitle[128];
@@ -0,0 +1,1006 @@
+// The host's implementation of pebble.h; see host.h for how tests and the replay driver drive it.
+
+#define HOST_RUNTIME
+#include "host.h"
+
+#include <stdarg.h>
+
+HostStats host_stats;
+bool host_verbose = false;
+char host_last_title[128];
+char host_last_subtitle[128];
+
+const char *host_handler_names[HOST_HANDLER_COUNT] = {
+    "in_received",
+    "draw_row",
+    "select"
+};
+
+static uint32_t nowMs = 0;
+
+static uint64_t wall_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static void handler_timed(HostHandler handler, uint64_t startNs) {
+    uint64_t elapsedNs = wall_ns() - startNs;
+    HostHandlerStats *stats = &host_stats.handlers[handler];
+    stats->calls++;
+    stats->totalNs += elapsedNs;
+    if (elapsedNs > stats->maxNs) {
+        stats->maxNs = elapsedNs;
+    }
+}
+
+
+/******* HEAP *******/
+
+// Each block costs its size plus the allocator's header, rounded up to the allocator's alignment; an
+// allocation that doesn't fit in what's left of HOST_HEAP_SIZE fails, as it would on the watch
+#define HEAP_BLOCK_OVERHEAD 8
+#define HEAP_ALIGNMENT 4
+
+typedef struct {
+    size_t size;
+    size_t cost;
+} __attribute__((aligned(16))) HeapBlock;
+
+static size_t heap_cost(size_t size) {
+    return ((size + HEAP_ALIGNMENT - 1) / HEAP_ALIGNMENT) * HEAP_ALIGNMENT + HEAP_BLOCK_OVERHEAD;
+}
+
+void *host_malloc(size_t size) {
+    size_t cost = heap_cost(size);
+    if (host_stats.heapUsed + cost > HOST_HEAP_SIZE) {
+        return NULL;
+    }
+    HeapBlock *block = malloc(sizeof(HeapBlock) + size);
+    if (block == NULL) {
+        return NULL;
+    }
+    block->size = size;
+    block->cost = cost;
+    host_stats.heapUsed += cost;
+    if (host_stats.heapUsed > host_stats.peakHeapUsed) {
+        host_stats.peakHeapUsed = host_stats.heapUsed;
+    }
+    return block + 1;
+}
+
+void *host_calloc(size_t count, size_t size) {
+    void *ptr = host_malloc(count * size);
+    if (ptr) {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+void host_free(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    HeapBlock *block = (HeapBlock *)ptr - 1;
+    host_stats.heapUsed -= block->cost;
+    free(block);
+}
+
+void *host_realloc(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return host_malloc(size);
+    }
+    HeapBlock *block = (HeapBlock *)ptr - 1;
+    void *moved = host_malloc(size);
+    if (moved == NULL) {
+        return NULL;
+    }
+    memcpy(moved, ptr, (block->size < size)? block->size : size);
+    host_free(ptr);
+    return moved;
+}
+
+size_t heap_bytes_used(void) {
+    return host_stats.heapUsed;
+}
+
+size_t heap_bytes_free(void) {
+    return HOST_HEAP_SIZE - host_stats.heapUsed;
+}
+
+// SDK objects come out of the app's heap too, at roughly what the 2.x firmware allocates for each
+#define WINDOW_BYTES 96
+#define MENU_LAYER_BYTES 236
+#define TEXT_LAYER_BYTES 64
+#define ACTION_BAR_LAYER_BYTES 160
+#define GBITMAP_HEADER_BYTES 16
+
+static void *sdk_object_create(size_t size, size_t firmwareBytes) {
+    return host_calloc(1, (size > firmwareBytes)? size : firmwareBytes);
+}
+
+
+/******* GRAPHICS *******/
+
+struct GBitmap {
+    uint16_t width;
+    uint16_t height;
+};
+
+GFont fonts_get_system_font(const char *font_key) {
+    return (GFont)font_key;
+}
+
+GBitmap *gbitmap_create_with_resource(uint32_t resource_id) {
+    // The sizes of the images in resources/images, which load as 1 bit bitmaps with rows padded to 32 bits
+    static const GSize sizes[] = {
+        [RESOURCE_ID_IMAGE_MENU_ICON_INDIGO_REMOTE] = { 24, 28 },
+        [RESOURCE_ID_IMAGE_MENU_ICON_DEVICE_MENU_ITEM] = { 24, 28 },
+        [RESOURCE_ID_IMAGE_MENU_ICON_ACTION_MENU_ITEM] = { 24, 28 },
+        [RESOURCE_ID_IMAGE_ACTION_ICON_PLUS] = { 16, 16 },
+        [RESOURCE_ID_IMAGE_ACTION_ICON_SELECT] = { 16, 16 },
+        [RESOURCE_ID_IMAGE_ACTION_ICON_MINUS] = { 16, 16 }
+    };
+    GSize size = (resource_id < sizeof(sizes) / sizeof(sizes[0]))? sizes[resource_id] : (GSize){ 0, 0 };
+    GBitmap *bitmap = sdk_object_create(sizeof(GBitmap), GBITMAP_HEADER_BYTES + ((size.w + 31) / 32) * 4 * size.h);
+    if (bitmap) {
+        bitmap->width = size.w;
+        bitmap->height = size.h;
+    }
+    return bitmap;
+}
+
+void gbitmap_destroy(GBitmap *bitmap) {
+    host_free(bitmap);
+}
+
+
+/******* WINDOWS AND LAYERS *******/
+
+#define SCREEN_WIDTH 144
+#define SCREEN_HEIGHT 152 // Below the status bar
+#define MAX_WINDOW_STACK_DEPTH 8
+
+struct Layer {
+    GRect frame;
+    Window *window; // The window it's been added to, if any
+    MenuLayer *menu; // The menu layer it belongs to, if any
+};
+
+struct Window {
+    Layer root;
+    WindowHandlers handlers;
+    ClickConfigProvider clickConfigProvider;
+    void *clickContext;
+    MenuLayer *menu; // The menu layer handling its buttons, if any
+    ClickHandler clickHandlers[NUM_BUTTONS];
+    bool loaded;
+    bool dirty;
+};
+
+struct TextLayer {
+    Layer layer;
+    const char *text;
+};
+
+struct ActionBarLayer {
+    Layer layer;
+    ClickConfigProvider clickConfigProvider;
+};
+
+static Window *windowStack[MAX_WINDOW_STACK_DEPTH];
+static int windowStackDepth = 0;
+static Window *configuringWindow = NULL; // The window whose click config provider is running
+
+Window *window_create(void) {
+    Window *window = sdk_object_create(sizeof(Window), WINDOW_BYTES);
+    window->root.frame = GRect(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
+    window->root.window = window;
+    return window;
+}
+
+void window_destroy(Window *window) {
+    host_free(window);
+}
+
+void window_set_window_handlers(Window *window, WindowHandlers handlers) {
+    window->handlers = handlers;
+}
+
+void window_set_click_config_provider(Window *window, ClickConfigProvider click_config_provider) {
+    window->clickConfigProvider = click_config_provider;
+    window->clickContext = window;
+}
+
+Layer *window_get_root_layer(const Window *window) {
+    return (Layer *)&window->root;
+}
+
+// Subscribe the window's buttons, once it's on top
+static void window_configure_clicks(Window *window) {
+    memset(window->clickHandlers, 0, sizeof(window->clickHandlers));
+    if (window->clickConfigProvider) {
+        configuringWindow = window;
+        window->clickConfigProvider(window->clickContext);
+        configuringWindow = NULL;
+    }
+}
+
+static void window_appear(Window *window) {
+    if (window->handlers.appear) {
+        window->handlers.appear(window);
+    }
+    window_configure_clicks(window);
+    window->dirty = true;
+}
+
+static void window_disappear(Window *window) {
+    if (window->handlers.disappear) {
+        window->handlers.disappear(window);
+    }
+}
+
+static void window_unload(Window *window) {
+    if (window->loaded && window->handlers.unload) {
+        window->handlers.unload(window);
+    }
+    window->loaded = false;
+    window->menu = NULL;
+    window->clickConfigProvider = NULL;
+}
+
+void window_stack_push(Window *window, bool animated) {
+    if (window_stack_contains_window(window) || (windowStackDepth == MAX_WINDOW_STACK_DEPTH)) {
+        return;
+    }
+    if (windowStackDepth > 0) {
+        window_disappear(windowStack[windowStackDepth - 1]);
+    }
+    windowStack[windowStackDepth++] = window;
+    if (!window->loaded) {
+        window->loaded = true;
+        if (window->handlers.load) {
+            window->handlers.load(window);
+        }
+    }
+    window_appear(window);
+}
+
+Window *window_stack_pop(bool animated) {
+    if (windowStackDepth == 0) {
+        return NULL;
+    }
+    Window *window = windowStack[--windowStackDepth];
+    window_disappear(window);
+    window_unload(window);
+    if (windowStackDepth > 0) {
+        window_appear(windowStack[windowStackDepth - 1]);
+    }
+    return window;
+}
+
+void window_stack_pop_all(const bool animated) {
+    if (windowStackDepth > 0) {
+        window_disappear(windowStack[windowStackDepth - 1]);
+    }
+    while (windowStackDepth > 0) {
+        window_unload(windowStack[--windowStackDepth]);
+    }
+}
+
+bool window_stack_contains_window(Window *window) {
+    for (int i = 0; i < windowStackDepth; i++) {
+        if (windowStack[i] == window) {
+            return true;
+        }
+    }
+    return false;
+}
+
+Window *window_stack_get_top_window(void) {
+    return (windowStackDepth > 0)? windowStack[windowStackDepth - 1] : NULL;
+}
+
+void window_single_click_subscribe(ButtonId button_id, ClickHandler handler) {
+    if (configuringWindow) {
+        configuringWindow->clickHandlers[button_id] = handler;
+    }
+}
+
+void window_single_repeating_click_subscribe(ButtonId button_id, uint16_t repeat_interval_ms, ClickHandler handler) {
+    window_single_click_subscribe(button_id, handler);
+}
+
+void window_multi_click_subscribe(ButtonId button_id, uint8_t min_clicks, uint8_t max_clicks, uint16_t timeout, bool last_click_only, ClickHandler handler) {
+}
+
+void window_long_click_subscribe(ButtonId button_id, uint16_t delay_ms, ClickHandler down_handler, ClickHandler up_handler) {
+}
+
+void window_raw_click_subscribe(ButtonId button_id, ClickHandler down_handler, ClickHandler up_handler, void *context) {
+}
+
+GRect layer_get_frame(const Layer *layer) {
+    return layer->frame;
+}
+
+GRect layer_get_bounds(const Layer *layer) {
+    return GRect(0, 0, layer->frame.size.w, layer->frame.size.h);
+}
+
+void layer_add_child(Layer *parent, Layer *child) {
+    child->window = parent->window;
+    if (child->menu && child->window && !child->window->menu) {
+        child->window->menu = child->menu;
+    }
+}
+
+void layer_mark_dirty(Layer *layer) {
+    if (layer->window) {
+        layer->window->dirty = true;
+    }
+}
+
+TextLayer *text_layer_create(GRect frame) {
+    TextLayer *text_layer = sdk_object_create(sizeof(TextLayer), TEXT_LAYER_BYTES);
+    text_layer->layer.frame = frame;
+    return text_layer;
+}
+
+void text_layer_destroy(TextLayer *text_layer) {
+    host_free(text_layer);
+}
+
+Layer *text_layer_get_layer(TextLayer *text_layer) {
+    return &text_layer->layer;
+}
+
+void text_layer_set_text(TextLayer *text_layer, const char *text) {
+    text_layer->text = text;
+    layer_mark_dirty(&text_layer->layer);
+}
+
+void text_layer_set_font(TextLayer *text_layer, GFont font) {
+}
+
+void text_layer_set_background_color(TextLayer *text_layer, GColor color) {
+}
+
+ActionBarLayer *action_bar_layer_create(void) {
+    return sdk_object_create(sizeof(ActionBarLayer), ACTION_BAR_LAYER_BYTES);
+}
+
+void action_bar_layer_destroy(ActionBarLayer *action_bar) {
+    host_free(action_bar);
+}
+
+void action_bar_layer_add_to_window(ActionBarLayer *action_bar, struct Window *window) {
+    layer_add_child(&window->root, &action_bar->layer);
+}
+
+void action_bar_layer_set_click_config_provider(ActionBarLayer *action_bar, ClickConfigProvider click_config_provider) {
+    action_bar->clickConfigProvider = click_config_provider;
+    if (action_bar->layer.window) {
+        action_bar->layer.window->clickConfigProvider = click_config_provider;
+        action_bar->layer.window->clickContext = action_bar;
+    }
+}
+
+void action_bar_layer_set_icon(ActionBarLayer *action_bar, ButtonId button_id, const GBitmap *icon) {
+}
+
+
+/******* MENU LAYER *******/
+
+struct MenuLayer {
+    Layer layer;
+    MenuLayerCallbacks callbacks;
+    void *context;
+    MenuIndex selected;
+};
+
+MenuLayer *menu_layer_create(GRect frame) {
+    MenuLayer *menu_layer = sdk_object_create(sizeof(MenuLayer), MENU_LAYER_BYTES);
+    menu_layer->layer.frame = frame;
+    menu_layer->layer.menu = menu_layer;
+    return menu_layer;
+}
+
+void menu_layer_destroy(MenuLayer *menu_layer) {
+    if (menu_layer->layer.window && (menu_layer->layer.window->menu == menu_layer)) {
+        menu_layer->layer.window->menu = NULL;
+    }
+    host_free(menu_layer);
+}
+
+Layer *menu_layer_get_layer(const MenuLayer *menu_layer) {
+    return (Layer *)&menu_layer->layer;
+}
+
+void menu_layer_set_callbacks(MenuLayer *menu_layer, void *callback_context, MenuLayerCallbacks callbacks) {
+    menu_layer->callbacks = callbacks;
+    menu_layer->context = callback_context;
+}
+
+void menu_layer_set_click_config_onto_window(MenuLayer *menu_layer, struct Window *window) {
+    window->menu = menu_layer;
+}
+
+static uint16_t menu_sections(MenuLayer *menu_layer) {
+    return menu_layer->callbacks.get_num_sections ? menu_layer->callbacks.get_num_sections(menu_layer, menu_layer->context) : 1;
+}
+
+static uint16_t menu_rows(MenuLayer *menu_layer, uint16_t section) {
+    return menu_layer->callbacks.get_num_rows ? menu_layer->callbacks.get_num_rows(menu_layer, section, menu_layer->context) : 0;
+}
+
+static int16_t menu_header_height(MenuLayer *menu_layer, uint16_t section) {
+    return menu_layer->callbacks.get_header_height ? menu_layer->callbacks.get_header_height(menu_layer, section, menu_layer->context) : 0;
+}
+
+static int16_t menu_cell_height(MenuLayer *menu_layer, MenuIndex index) {
+    return menu_layer->callbacks.get_cell_height ? menu_layer->callbacks.get_cell_height(menu_layer, &index, menu_layer->context) : MENU_CELL_BASIC_CELL_HEIGHT;
+}
+
+void menu_layer_reload_data(MenuLayer *menu_layer) {
+    uint16_t rows = menu_rows(menu_layer, menu_layer->selected.section);
+    if ((rows > 0) && (menu_layer->selected.row >= rows)) {
+        menu_layer->selected.row = rows - 1;
+    }
+    layer_mark_dirty(&menu_layer->layer);
+}
+
+MenuIndex menu_layer_get_selected_index(const MenuLayer *menu_layer) {
+    return menu_layer->selected;
+}
+
+void menu_layer_set_selected_index(MenuLayer *menu_layer, MenuIndex index, MenuRowAlign scroll_align, bool animated) {
+    MenuIndex old = menu_layer->selected;
+    menu_layer->selected = index;
+    if (menu_layer->callbacks.selection_changed && ((old.section != index.section) || (old.row != index.row))) {
+        menu_layer->callbacks.selection_changed(menu_layer, index, old, menu_layer->context);
+    }
+    layer_mark_dirty(&menu_layer->layer);
+}
+
+// Draw the headers and rows that are on screen, scrolled to keep the selected row in the middle
+static void menu_layer_draw(MenuLayer *menu_layer) {
+    int32_t y = 0, selectedY = 0, selectedHeight = 0;
+    uint16_t sections = menu_sections(menu_layer);
+    for (uint16_t section = 0; section < sections; section++) {
+        y += menu_header_height(menu_layer, section);
+        if (section == menu_layer->selected.section) {
+            for (uint16_t row = 0; row < menu_layer->selected.row; row++) {
+                y += menu_cell_height(menu_layer, MenuIndex(section, row));
+            }
+            selectedY = y;
+            selectedHeight = menu_cell_height(menu_layer, menu_layer->selected);
+            break;
+        }
+        for (uint16_t row = 0, rows = menu_rows(menu_layer, section); row < rows; row++) {
+            y += menu_cell_height(menu_layer, MenuIndex(section, row));
+        }
+    }
+    int32_t height = menu_layer->layer.frame.size.h;
+    int32_t top = selectedY + selectedHeight / 2 - height / 2;
+    if (top < 0) {
+        top = 0;
+    }
+
+    y = 0;
+    for (uint16_t section = 0; (section < sections) && (y < top + height); section++) {
+        int16_t headerHeight = menu_header_height(menu_layer, section);
+        if ((headerHeight > 0) && (y + headerHeight > top) && menu_layer->callbacks.draw_header) {
+            menu_layer->callbacks.draw_header(NULL, &menu_layer->layer, section, menu_layer->context);
+        }
+        y += headerHeight;
+        for (uint16_t row = 0, rows = menu_rows(menu_layer, section); (row < rows) && (y < top + height); row++) {
+            MenuIndex index = MenuIndex(section, row);
+            int16_t cellHeight = menu_cell_height(menu_layer, index);
+            if ((y + cellHeight > top) && menu_layer->callbacks.draw_row) {
+                uint64_t startNs = wall_ns();
+                menu_layer->callbacks.draw_row(NULL, &menu_layer->layer, &index, menu_layer->context);
+                handler_timed(HOST_DRAW_ROW, startNs);
+                host_stats.rowsDrawn++;
+            }
+            y += cellHeight;
+        }
+    }
+}
+
+void menu_cell_basic_draw(GContext *ctx, const Layer *cell_layer, const char *title, const char *subtitle, GBitmap *icon) {
+    snprintf(host_last_title, sizeof(host_last_title), "%s", title ? title : "");
+    snprintf(host_last_subtitle, sizeof(host_last_subtitle), "%s", subtitle ? subtitle : "");
+}
+
+void menu_cell_title_draw(GContext *ctx, const Layer *cell_layer, const char *title) {
+    menu_cell_basic_draw(ctx, cell_layer, title, NULL, NULL);
+}
+
+void menu_cell_basic_header_draw(GContext *ctx, const Layer *cell_layer, const char *title) {
+}
+
+
+/******* DICTIONARY *******/
+
+#define TUPLE_HEADER_SIZE (sizeof(Tuple))
+
+DictionaryResult dict_write_begin(DictionaryIterator *iter, uint8_t *buffer, const uint16_t size) {
+    if ((buffer == NULL) || (size < 1)) {
+        return DICT_INVALID_ARGS;
+    }
+    iter->dictionary = buffer;
+    iter->dictionary[0] = 0;
+    iter->cursor = (Tuple *)(buffer + 1);
+    iter->end = buffer + size;
+    return DICT_OK;
+}
+
+static DictionaryResult dict_write(DictionaryIterator *iter, uint32_t key, TupleType type, const void *data, uint16_t length) {
+    uint8_t *at = (uint8_t *)iter->cursor;
+    if (at + TUPLE_HEADER_SIZE + length > iter->end) {
+        return DICT_NOT_ENOUGH_STORAGE;
+    }
+    iter->cursor->key = key;
+    iter->cursor->type = type;
+    iter->cursor->length = length;
+    memcpy(iter->cursor->value->data, data, length);
+    iter->cursor = (Tuple *)(at + TUPLE_HEADER_SIZE + length);
+    iter->dictionary[0]++;
+    return DICT_OK;
+}
+
+DictionaryResult dict_write_data(DictionaryIterator *iter, const uint32_t key, const uint8_t *data, const uint16_t size) {
+    return dict_write(iter, key, TUPLE_BYTE_ARRAY, data, size);
+}
+
+DictionaryResult dict_write_cstring(DictionaryIterator *iter, const uint32_t key, const char *cstring) {
+    return dict_write(iter, key, TUPLE_CSTRING, cstring, cstring ? strlen(cstring) + 1 : 0);
+}
+
+DictionaryResult dict_write_int(DictionaryIterator *iter, const uint32_t key, const void *integer, const uint8_t width_bytes, const bool is_signed) {
+    if ((width_bytes != 1) && (width_bytes != 2) && (width_bytes != 4)) {
+        return DICT_INVALID_ARGS;
+    }
+    return dict_write(iter, key, is_signed ? TUPLE_INT : TUPLE_UINT, integer, width_bytes);
+}
+
+DictionaryResult dict_write_uint8(DictionaryIterator *iter, const uint32_t key, const uint8_t value) {
+    return dict_write_int(iter, key, &value, sizeof(value), false);
+}
+
+DictionaryResult dict_write_uint16(DictionaryIterator *iter, const uint32_t key, const uint16_t value) {
+    return dict_write_int(iter, key, &value, sizeof(value), false);
+}
+
+DictionaryResult dict_write_uint32(DictionaryIterator *iter, const uint32_t key, const uint32_t value) {
+    return dict_write_int(iter, key, &value, sizeof(value), false);
+}
+
+DictionaryResult dict_write_tuplet(DictionaryIterator *iter, const Tuplet * const tuplet) {
+    switch (tuplet->type) {
+        case TUPLE_BYTE_ARRAY:
+            return dict_write_data(iter, tuplet->key, tuplet->bytes.data, tuplet->bytes.length);
+        case TUPLE_CSTRING:
+            return dict_write(iter, tuplet->key, TUPLE_CSTRING, tuplet->cstring.data, tuplet->cstring.length);
+        default:
+            return dict_write_int(iter, tuplet->key, &tuplet->integer.storage, tuplet->integer.width, tuplet->type == TUPLE_INT);
+    }
+}
+
+uint32_t dict_write_end(DictionaryIterator *iter) {
+    iter->end = (uint8_t *)iter->cursor;
+    return iter->end - iter->dictionary;
+}
+
+Tuple *dict_read_first(DictionaryIterator *iter) {
+    iter->cursor = (Tuple *)(iter->dictionary + 1);
+    return (iter->dictionary[0] > 0)? iter->cursor : NULL;
+}
+
+Tuple *dict_read_next(DictionaryIterator *iter) {
+    uint8_t *next = (uint8_t *)iter->cursor + TUPLE_HEADER_SIZE + iter->cursor->length;
+    if (next + TUPLE_HEADER_SIZE > iter->end) {
+        return NULL;
+    }
+    iter->cursor = (Tuple *)next;
+    return iter->cursor;
+}
+
+Tuple *dict_find(const DictionaryIterator *iter, const uint32_t key) {
+    DictionaryIterator reader = *iter;
+    for (Tuple *tuple = dict_read_first(&reader); tuple; tuple = dict_read_next(&reader)) {
+        if (tuple->key == key) {
+            return tuple;
+        }
+    }
+    return NULL;
+}
+
+
+/******* APP MESSAGE *******/
+
+// Messages from the phone are written into a buffer bigger than any inbox, so one that doesn't fit the
+// inbox the app opened is dropped as it would be on the watch
+#define MESSAGE_BUFFER_SIZE 8192
+
+static AppMessageInboxReceived inboxReceived;
+static AppMessageInboxDropped inboxDropped;
+static AppMessageOutboxSent outboxSent;
+static AppMessageOutboxFailed outboxFailed;
+static uint8_t *messageBuffers = NULL; // The app's inbox and outbox, taken from its heap as on the watch
+static uint32_t inboxSize = 0;
+static uint32_t outboxSize = 0;
+
+static uint8_t inboxBuffer[MESSAGE_BUFFER_SIZE];
+static DictionaryIterator inboxIterator;
+static uint8_t outboxBuffer[MESSAGE_BUFFER_SIZE];
+static DictionaryIterator outboxIterator;
+static bool outboxWriting = false;
+static bool outboxSending = false;
+
+AppMessageInboxReceived app_message_register_inbox_received(AppMessageInboxReceived received_callback) {
+    AppMessageInboxReceived previous = inboxReceived;
+    inboxReceived = received_callback;
+    return previous;
+}
+
+AppMessageInboxDropped app_message_register_inbox_dropped(AppMessageInboxDropped dropped_callback) {
+    AppMessageInboxDropped previous = inboxDropped;
+    inboxDropped = dropped_callback;
+    return previous;
+}
+
+AppMessageOutboxSent app_message_register_outbox_sent(AppMessageOutboxSent sent_callback) {
+    AppMessageOutboxSent previous = outboxSent;
+    outboxSent = sent_callback;
+    return previous;
+}
+
+AppMessageOutboxFailed app_message_register_outbox_failed(AppMessageOutboxFailed failed_callback) {
+    AppMessageOutboxFailed previous = outboxFailed;
+    outboxFailed = failed_callback;
+    return previous;
+}
+
+uint32_t app_message_inbox_size_maximum(void) {
+    return HOST_INBOX_SIZE_MAXIMUM;
+}
+
+uint32_t app_message_outbox_size_maximum(void) {
+    return HOST_OUTBOX_SIZE_MAXIMUM;
+}
+
+AppMessageResult app_message_open(const uint32_t size_inbound, const uint32_t size_outbound) {
+    if ((size_inbound > HOST_INBOX_SIZE_MAXIMUM) || (size_outbound > HOST_OUTBOX_SIZE_MAXIMUM)) {
+        return APP_MSG_BUFFER_OVERFLOW;
+    }
+    host_free(messageBuffers);
+    messageBuffers = host_malloc(size_inbound + size_outbound);
+    if (messageBuffers == NULL) {
+        return APP_MSG_OUT_OF_MEMORY;
+    }
+    inboxSize = size_inbound;
+    outboxSize = size_outbound;
+    return APP_MSG_OK;
+}
+
+AppMessageResult app_message_outbox_begin(DictionaryIterator **iterator) {
+    if ((messageBuffers == NULL) || outboxSending) {
+        *iterator = NULL;
+        return APP_MSG_BUSY;
+    }
+    dict_write_begin(&outboxIterator, outboxBuffer, outboxSize);
+    outboxWriting = true;
+    *iterator = &outboxIterator;
+    return APP_MSG_OK;
+}
+
+AppMessageResult app_message_outbox_send(void) {
+    if (!outboxWriting) {
+        return APP_MSG_BUSY;
+    }
+    dict_write_end(&outboxIterator);
+    outboxWriting = false;
+    outboxSending = true;
+    host_stats.messagesSent++;
+    return APP_MSG_OK;
+}
+
+DictionaryIterator *host_message_begin(void) {
+    dict_write_begin(&inboxIterator, inboxBuffer, sizeof(inboxBuffer));
+    return &inboxIterator;
+}
+
+void host_message_deliver(void) {
+    uint32_t size = dict_write_end(&inboxIterator);
+    if ((messageBuffers == NULL) || (size > inboxSize)) {
+        if (inboxDropped) {
+            inboxDropped(APP_MSG_BUFFER_OVERFLOW, NULL);
+        }
+    }
+    else if (inboxReceived) {
+        host_stats.messagesReceived++;
+        uint64_t startNs = wall_ns();
+        inboxReceived(&inboxIterator, NULL);
+        handler_timed(HOST_IN_RECEIVED, startNs);
+    }
+    host_render();
+}
+
+DictionaryIterator *host_outbox(void) {
+    return outboxSending ? &outboxIterator : NULL;
+}
+
+void host_outbox_finish(bool delivered) {
+    if (!outboxSending) {
+        return;
+    }
+    outboxSending = false;
+    if (delivered && outboxSent) {
+        outboxSent(&outboxIterator, NULL);
+    }
+    else if (!delivered && outboxFailed) {
+        outboxFailed(&outboxIterator, APP_MSG_SEND_TIMEOUT, NULL);
+    }
+    host_render();
+}
+
+
+/******* TIMERS AND TIME *******/
+
+#define MAX_TIMERS 64
+
+struct AppTimer {
+    bool active;
+    uint32_t dueMs;
+    uint32_t sequence; // Timers due at the same time fire in the order they were registered
+    AppTimerCallback callback;
+    void *data;
+};
+
+static struct AppTimer timers[MAX_TIMERS];
+static uint32_t timerSequence = 0;
+
+AppTimer *app_timer_register(uint32_t timeout_ms, AppTimerCallback callback, void *callback_data) {
+    for (int i = 0; i < MAX_TIMERS; i++) {
+        if (!timers[i].active) {
+            timers[i] = (struct AppTimer){ true, nowMs + timeout_ms, timerSequence++, callback, callback_data };
+            return &timers[i];
+        }
+    }
+    return NULL;
+}
+
+bool app_timer_reschedule(AppTimer *timer_handle, uint32_t new_timeout_ms) {
+    if ((timer_handle == NULL) || !timer_handle->active) {
+        return false;
+    }
+    timer_handle->dueMs = nowMs + new_timeout_ms;
+    timer_handle->sequence = timerSequence++;
+    return true;
+}
+
+void app_timer_cancel(AppTimer *timer_handle) {
+    if (timer_handle) {
+        timer_handle->active = false;
+    }
+}
+
+uint32_t host_now(void) {
+    return nowMs;
+}
+
+void host_advance(uint32_t ms) {
+    uint32_t endMs = nowMs + ms;
+    for (;;) {
+        struct AppTimer *next = NULL;
+        for (int i = 0; i < MAX_TIMERS; i++) {
+            if (timers[i].active && (timers[i].dueMs <= endMs) &&
+                ((next == NULL) || (timers[i].dueMs < next->dueMs) ||
+                 ((timers[i].dueMs == next->dueMs) && (timers[i].sequence < next->sequence)))) {
+                next = &timers[i];
+            }
+        }
+        if (next == NULL) {
+            break;
+        }
+        if (next->dueMs > nowMs) {
+            nowMs = next->dueMs;
+        }
+        next->active = false;
+        next->callback(next->data);
+        host_render();
+    }
+    nowMs = endMs;
+}
+
+uint16_t time_ms(time_t *t_utc, uint16_t *out_ms) {
+    if (t_utc) {
+        *t_utc = nowMs / 1000;
+    }
+    if (out_ms) {
+        *out_ms = nowMs % 1000;
+    }
+    return nowMs % 1000;
+}
+
+
+/******* BUTTONS AND THE SCREEN *******/
+
+static MenuLayer *top_menu_layer(void) {
+    Window *window = window_stack_get_top_window();
+    return window ? window->menu : NULL;
+}
+
+void host_select(void) {
+    MenuLayer *menu_layer = top_menu_layer();
+    if (menu_layer && menu_layer->callbacks.select_click) {
+        MenuIndex index = menu_layer->selected;
+        uint64_t startNs = wall_ns();
+        menu_layer->callbacks.select_click(menu_layer, &index, menu_layer->context);
+        handler_timed(HOST_SELECT, startNs);
+        host_render();
+    }
+    else if (!menu_layer) {
+        host_button(BUTTON_ID_SELECT);
+    }
+}
+
+void host_long_select(void) {
+    MenuLayer *menu_layer = top_menu_layer();
+    if (menu_layer && menu_layer->callbacks.select_long_click) {
+        MenuIndex index = menu_layer->selected;
+        menu_layer->callbacks.select_long_click(menu_layer, &index, menu_layer->context);
+        host_render();
+    }
+}
+
+void host_scroll_to(uint16_t row) {
+    MenuLayer *menu_layer = top_menu_layer();
+    if (menu_layer == NULL) {
+        return;
+    }
+    uint16_t rows = menu_rows(menu_layer, menu_layer->selected.section);
+    if (row >= rows) {
+        row = (rows > 0)? rows - 1 : 0;
+    }
+    // A row at a time, as each click of up or down would
+    while (menu_layer->selected.row != row) {
+        MenuIndex index = menu_layer->selected;
+        index.row += (row > index.row)? 1 : -1;
+        menu_layer_set_selected_index(menu_layer, index, MenuRowAlignCenter, true);
+        host_render();
+        menu_layer = top_menu_layer();
+        if (menu_layer == NULL) {
+            return;
+        }
+    }
+}
+
+void host_back(void) {
+    if (windowStackDepth > 1) {
+        window_stack_pop(true);
+        host_render();
+    }
+}
+
+void host_button(ButtonId button) {
+    Window *window = window_stack_get_top_window();
+    if (window && window->clickHandlers[button]) {
+        uint64_t startNs = wall_ns();
+        window->clickHandlers[button](NULL, window->clickContext);
+        if (button == BUTTON_ID_SELECT) {
+            handler_timed(HOST_SELECT, startNs);
+        }
+        host_render();
+    }
+}
+
+void host_render(void) {
+    Window *window = window_stack_get_top_window();
+    if ((window == NULL) || !window->dirty) {
+        return;
+    }
+    window->dirty = false;
+    host_stats.frames++;
+    if (window->menu) {
+        menu_layer_draw(window->menu);
+    }
+}
+
+
+/******* STORAGE *******/
+
+#define MAX_PERSIST_KEYS 256
+
+static struct {
+    uint32_t key;
+    uint16_t size; // 0 if the slot is free
+    uint8_t data[PERSIST_DATA_MAX_LENGTH];
+} persisted[MAX_PERSIST_KEYS];
+
+static int persist_slot(const uint32_t key) {
+    for (int i = 0; i < MAX_PERSIST_KEYS; i++) {
+        if ((persisted[i].size > 0) && (persisted[i].key == key)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool persist_exists(const uint32_t key) {
+    return persist_slot(key) >= 0;
+}
+
+int persist_get_size(const uint32_t key) {
+    int slot = persist_slot(key);
+    return (slot >= 0)? persisted[slot].size : E_DOES_NOT_EXIST;
+}
+
+int persist_read_data(const uint32_t key, void *buffer, const size_t buffer_size) {
+    int slot = persist_slot(key);
+    if (slot < 0) {
+        return E_DOES_NOT_EXIST;
+    }
+    size_t size = (persisted[slot].size < buffer_size)? persisted[slot].size : buffer_size;
+    memcpy(buffer, persisted[slot].data, size);
+    return size;
+}
+
+int32_t persist_read_int(const uint32_t key) {
+    int32_t value = 0;
+    persist_read_data(key, &value, sizeof(value));
+    return value;
+}
+
+int persist_write_data(const uint32_t key, const void *data, const size_t size) {
+    if ((size == 0) || (size > PERSIST_DATA_MAX_LENGTH)) {
+        return E_DOES_NOT_EXIST;
+    }
+    int slot = persist_slot(key);
+    for (int i = 0; (slot < 0) && (i < MAX_PERSIST_KEYS); i++) {
+        if (persisted[i].size == 0) {
+            slot = i;
+        }
+    }
+    if (slot < 0) {
+        return E_DOES_NOT_EXIST;
+    }
+    persisted[slot].key = key;
+    persisted[slot].size = size;
+    memcpy(persisted[slot].data, data, size);
+    return size;
+}
+
+status_t persist_write_int(const uint32_t key, const int32_t value) {
+    return persist_write_data(key, &value, sizeof(value));
+}
+
+status_t persist_delete(const uint32_t key) {
+    int slot = persist_slot(key);
+    if (slot < 0) {
+        return E_DOES_NOT_EXIST;
+    }
+    persisted[slot].size = 0;
+    return S_SUCCESS;
+}
+
+
+/******* LOGGING AND THE EVENT LOOP *******/
+
+void app_log(uint8_t log_level, const char *src_filename, int src_line_number, const char *fmt, ...) {
+    if (!host_verbose) {
+        return;
+    }
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "[%6u ms] %s:%d ", nowMs, src_filename, src_line_number);
+    vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+
+void app_event_loop(void) {
+    // The driver runs the loop, one event at a time
+}
@@ -0,0 +1,319 @@
+// Replays a trace of what the phone sent the watch (and what the user pressed) through the watch app built
+// for the host, then reports how long its handlers took, how many messages went each way, how much it drew
+// and how much heap it used.
+//
+//     replay [--ack-ms N] [--verbose] trace
+//
+// A trace has one event per line, each at a time in ms since the app started, in order; # starts a comment:
+//
+//     <ms> phone <key>=<value>...    A message from the phone, keys numbered as in appinfo.json's appKeys,
+//                                    values u:<unsigned>, i:<signed>, s:<text, %XX escaped> or x:<hex bytes>
+//     <ms> select | long_select | back
+//     <ms> scroll <row>              Move the selection to the row, a row at a time
+//     <ms> button up|down|select     A button on a window without a menu, e.g. the dim window
+//     <ms> expect <counter> <op> <n> A count so far (frames, rows_drawn, redraws, coalesced, received or sent)
+//                                    compared by <, <=, ==, >= or >
+//     <ms> expect device <row> <text> The device row's subtitle, %XX escaped as above
+//     <ms> expect device_name <row> <text>  The device row's name, likewise
+//
+// Every message the app sends reaches the phone --ack-ms (default 20) after it's sent. The app is left to
+// settle for SETTLE_MS after the last event before the report.
+//
+// Fails if an expectation doesn't hold, or if the heap went over the app's budget, either where the app checks it (as each window loads and
+// unloads and each list finishes syncing) or at its peak, against the budget for the lists it ended with.
+
+#define main indigo_remote_main
+#include "../../src/main.c"
+#undef main
+
+#include "host.h"
+
+#define MAX_TRACE_LINE 20000
+#define SETTLE_MS 2000
+
+static uint32_t ackMs = 20;
+static uint32_t expectationsFailed = 0;
+static uint32_t ackDueMs = 0;
+static bool ackScheduled = false;
+
+// Run the clock to the given time, with the phone taking each message the app sends ackMs after it's sent
+static void advance_to(uint32_t ms) {
+    for (;;) {
+        if (!ackScheduled && host_outbox()) {
+            ackScheduled = true;
+            ackDueMs = host_now() + ackMs;
+        }
+        if (!ackScheduled || (ackDueMs > ms)) {
+            break;
+        }
+        if (ackDueMs > host_now()) {
+            host_advance(ackDueMs - host_now());
+        }
+        ackScheduled = false;
+        host_outbox_finish(true);
+    }
+    if (ms > host_now()) {
+        host_advance(ms - host_now());
+    }
+}
+
+static int hex_digit(char c) {
+    if ((c >= '0') && (c <= '9')) {
+        return c - '0';
+    }
+    if ((c >= 'a') && (c <= 'f')) {
+        return c - 'a' + 10;
+    }
+    if ((c >= 'A') && (c <= 'F')) {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// Decode %XX escapes; text may be the same buffer as value, as it's never longer
+static void unescape(const char *value, char *text) {
+    for (; *value; value++) {
+        if ((value[0] == '%') && (hex_digit(value[1]) >= 0) && (hex_digit(value[2]) >= 0)) {
+            *text++ = (hex_digit(value[1]) << 4) | hex_digit(value[2]);
+            value += 2;
+        }
+        else {
+            *text++ = *value;
+        }
+    }
+    *text = '\0';
+}
+
+// Write one key=value of a phone message; returns false if it's malformed
+static bool write_tuple(DictionaryIterator *iter, const char *field) {
+    static uint8_t bytes[MAX_TRACE_LINE / 2];
+    char *value;
+    uint32_t key = strtoul(field, &value, 10);
+    if ((value[0] != '=') || (value[1] == '\0') || (value[2] != ':')) {
+        return false;
+    }
+    char type = value[1];
+    value += 3;
+    if (type == 'u') {
+        return dict_write_uint32(iter, key, strtoul(value, NULL, 10)) == DICT_OK;
+    }
+    if (type == 'i') {
+        int32_t integer = strtol(value, NULL, 10);
+        return dict_write_int(iter, key, &integer, sizeof(integer), true) == DICT_OK;
+    }
+    uint16_t length = 0;
+    if (type == 'x') {
+        for (; value[0] && value[1]; value += 2) {
+            bytes[length++] = (hex_digit(value[0]) << 4) | hex_digit(value[1]);
+        }
+        return dict_write_data(iter, key, bytes, length) == DICT_OK;
+    }
+    if (type == 's') {
+        unescape(value, (char *)bytes);
+        return dict_write_cstring(iter, key, (const char *)bytes) == DICT_OK;
+    }
+    return false;
+}
+
+static bool counter_value(const char *counter, uint32_t *value) {
+    if (strcmp(counter, "frames") == 0) {
+        *value = host_stats.frames;
+    }
+    else if (strcmp(counter, "rows_drawn") == 0) {
+        *value = host_stats.rowsDrawn;
+    }
+    else if (strcmp(counter, "redraws") == 0) {
+        *value = profile_stats.redraws;
+    }
+    else if (strcmp(counter, "coalesced") == 0) {
+        *value = profile_stats.redrawsCoalesced;
+    }
+    else if (strcmp(counter, "received") == 0) {
+        *value = host_stats.messagesReceived;
+    }
+    else if (strcmp(counter, "sent") == 0) {
+        *value = host_stats.messagesSent;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+// Check an expectation, reporting it if it doesn't hold; returns false if it's malformed
+static bool expect(const char *where, char *args) {
+    char *subject = strtok(args, " \t\n");
+    if (subject == NULL) {
+        return false;
+    }
+    if ((strcmp(subject, "device") == 0) || (strcmp(subject, "device_name") == 0)) {
+        char *row = strtok(NULL, " \t\n");
+        char *text = strtok(NULL, " \t\n");
+        if ((row == NULL) || (text == NULL)) {
+            return false;
+        }
+        unescape(text, text);
+        uint16_t number = strtoul(row, NULL, 10);
+        DeviceData *device = (number < deviceCount)? device_data(number) : NULL;
+        const char *shown = (device == NULL)? "(no row)" :
+            (strcmp(subject, "device_name") == 0)? device_name(number) :
+            status_text(device_status_texts, sizeof(device_status_texts) / sizeof(device_status_texts[0]), device->on);
+        if (strcmp(shown, text) != 0) {
+            fprintf(stderr, "%s: expected %s %u to be \"%s\", it's \"%s\"\n", where, subject, number, text, shown);
+            expectationsFailed++;
+        }
+        return true;
+    }
+    char *op = strtok(NULL, " \t\n");
+    char *operand = strtok(NULL, " \t\n");
+    uint32_t value;
+    if ((op == NULL) || (operand == NULL) || !counter_value(subject, &value)) {
+        return false;
+    }
+    uint32_t n = strtoul(operand, NULL, 10);
+    bool holds;
+    if (strcmp(op, "<") == 0) {
+        holds = value < n;
+    }
+    else if (strcmp(op, "<=") == 0) {
+        holds = value <= n;
+    }
+    else if (strcmp(op, "==") == 0) {
+        holds = value == n;
+    }
+    else if (strcmp(op, ">=") == 0) {
+        holds = value >= n;
+    }
+    else if (strcmp(op, ">") == 0) {
+        holds = value > n;
+    }
+    else {
+        return false;
+    }
+    if (!holds) {
+        fprintf(stderr, "%s: expected %s %s %u, got %u\n", where, subject, op, n, value);
+        expectationsFailed++;
+    }
+    return true;
+}
+
+static bool replay_event(const char *where, const char *event, char *args) {
+    if (strcmp(event, "phone") == 0) {
+        DictionaryIterator *iter = host_message_begin();
+        for (char *field = strtok(args, " \t\n"); field; field = strtok(NULL, " \t\n")) {
+            if (!write_tuple(iter, field)) {
+                return false;
+            }
+        }
+        host_message_deliver();
+    }
+    else if (strcmp(event, "select") == 0) {
+        host_select();
+    }
+    else if (strcmp(event, "long_select") == 0) {
+        host_long_select();
+    }
+    else if (strcmp(event, "back") == 0) {
+        host_back();
+    }
+    else if (strcmp(event, "scroll") == 0) {
+        host_scroll_to(strtoul(args, NULL, 10));
+    }
+    else if (strcmp(event, "expect") == 0) {
+        return expect(where, args);
+    }
+    else if (strcmp(event, "button") == 0) {
+        char *button = strtok(args, " \t\n");
+        if (button == NULL) {
+            return false;
+        }
+        host_button((strcmp(button, "up") == 0)? BUTTON_ID_UP : (strcmp(button, "down") == 0)? BUTTON_ID_DOWN : BUTTON_ID_SELECT);
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+static bool replay(const char *path) {
+    static char line[MAX_TRACE_LINE];
+    FILE *trace = fopen(path, "r");
+    if (trace == NULL) {
+        perror(path);
+        return false;
+    }
+    for (int lineNumber = 1; fgets(line, sizeof(line), trace); lineNumber++) {
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        char *rest;
+        uint32_t ms = strtoul(line, &rest, 10);
+        char event[16];
+        int eventLength = 0;
+        if ((rest == line) || (sscanf(rest, " %15s %n", event, &eventLength) < 1)) {
+            continue; // Blank
+        }
+        advance_to(ms);
+        char where[512];
+        snprintf(where, sizeof(where), "%s:%d", path, lineNumber);
+        if (!replay_event(where, event, rest + eventLength)) {
+            fprintf(stderr, "%s: can't replay \"%s\"\n", where, event);
+            fclose(trace);
+            return false;
+        }
+    }
+    fclose(trace);
+    advance_to(host_now() + SETTLE_MS);
+    return true;
+}
+
+// Returns whether the heap stayed within budget
+static bool report(const char *path) {
+    printf("%s: %u ms\n", path, host_now());
+    printf("  messages: %u from the phone (%u dropped), %u to the phone (%u failed)\n",
+           host_stats.messagesReceived, profile_stats.messagesDropped, host_stats.messagesSent, profile_stats.messagesFailed);
+    printf("  drawing: %u frames, %u rows drawn; %u redraws, %u coalesced into them\n",
+           host_stats.frames, host_stats.rowsDrawn, profile_stats.redraws, profile_stats.redrawsCoalesced);
+    printf("  commands: %u retried, %u collapsed, %u abandoned\n",
+           profile_stats.commandsRetried, profile_stats.commandsCollapsed, profile_stats.commandsAbandoned);
+    for (int i = 0; i < HOST_HANDLER_COUNT; i++) {
+        HostHandlerStats *stats = &host_stats.handlers[i];
+        printf("  %-12s %6u calls, mean %7.1f us, max %7.1f us\n", host_handler_names[i], stats->calls,
+               stats->calls ? stats->totalNs / 1000.0 / stats->calls : 0.0, stats->maxNs / 1000.0);
+    }
+    size_t budget = profile_heap_budget();
+    bool withinBudget = (host_stats.peakHeapUsed <= budget) && (profile_stats.heapOverBudget == 0);
+    printf("  heap: peak %zu, now %zu, budget %zu for %u devices and %u actions; over budget at %u checks%s\n",
+           host_stats.peakHeapUsed, host_stats.heapUsed, budget, deviceCapacity, actionCapacity,
+           profile_stats.heapOverBudget, withinBudget ? "" : ", OVER BUDGET");
+    return withinBudget;
+}
+
+int main(int argc, char **argv) {
+    int first = 1;
+    for (; (first < argc) && (strncmp(argv[first], "--", 2) == 0); first++) {
+        if ((strcmp(argv[first], "--ack-ms") == 0) && (first + 1 < argc)) {
+            ackMs = strtoul(argv[++first], NULL, 10);
+        }
+        else if (strcmp(argv[first], "--verbose") == 0) {
+            host_verbose = true;
+        }
+        else {
+            break;
+        }
+    }
+    if (first != argc - 1) {
+        fprintf(stderr, "usage: %s [--ack-ms N] [--verbose] trace\n", argv[0]);
+        return 2;
+    }
+
+    init();
+    host_render();
+    if (!replay(argv[first])) {
+        return 1;
+    }
+    bool withinBudget = report(argv[first]);
+    deinit();
+    return (withinBudget && (expectationsFailed == 0)) ? 0 : 1;
+}
@@ -0,0 +1,199 @@
+// Times a sync of the watch's lists from a mock Indigo Server at each of a number of list sizes, on the virtual
+// clock (see phone.js), and reports:
+//
+//   first row    ms from the watch asking for its lists to the first device row sent to it
+//   complete     ms until both lists have been sent in full (or the watch told one couldn't be fetched)
+//   messages     app messages to the watch until then
+//   requests     HTTP requests to the server until then
+//   poll/min     HTTP requests in the minute after, with the devices list on screen, as it polls
+//   cpu          ms the script itself ran for, in real time
+//
+//     node bench.js [--devices 10,50,500,5000] [--actions N] [--latency ms] [--fail rate] [--ack-ms ms] [--warm]
+//     node bench.js --devices N --record file.trace [--scenario sync|toggle]
+//
+// --warm syncs a second time from the first sync's saved state, as when the app is opened again. --record
+// writes what the phone sent the watch as a trace for test/host's replay driver, with the watch's buttons
+// for the scenario: toggle opens the devices list and toggles its fourth row once the sync is done.
+
+var fs = require("fs");
+var path = require("path");
+var MockIndigo = require("./mock-indigo");
+var Phone = require("./phone");
+
+var APP_KEYS = JSON.parse(fs.readFileSync(path.join(__dirname, "../../appinfo.json"), "utf8")).appKeys;
+
+// What the watch tells the phone when it asks for its lists (see COMMAND_GET_DEVICES_AND_ACTIONS in main.c)
+var WATCH_REQUEST = {
+    "get_devices_and_actions": 1,
+    "inbox_size": 2026,
+    "max_devices": 500,
+    "device_window_size": 64,
+    "visible_list": 1,
+    "visible_row": 0,
+    "visible_row_count": 4
+};
+var COULD_NOT_CONNECT_DEVICES = 1;
+var COULD_NOT_CONNECT_ACTIONS = 2;
+var POLL_WINDOW_MS = 60000;
+var SYNC_LIMIT_MS = 600000;
+
+function parseArgs(argv) {
+    var args = {devices: [10, 50, 500, 5000], actions: null, latency: 20, fail: 0, ackMs: 20, warm: false, record: null, scenario: "sync"};
+    for (var i = 0; i < argv.length; i += 1) {
+        var value = argv[i + 1];
+        switch (argv[i]) {
+        case "--devices": args.devices = value.split(",").map(Number); i += 1; break;
+        case "--actions": args.actions = Number(value); i += 1; break;
+        case "--latency": args.latency = Number(value); i += 1; break;
+        case "--fail": args.fail = Number(value); i += 1; break;
+        case "--ack-ms": args.ackMs = Number(value); i += 1; break;
+        case "--record": args.record = value; i += 1; break;
+        case "--scenario": args.scenario = value; i += 1; break;
+        case "--warm": args.warm = true; break;
+        default:
+            console.error("usage: node bench.js [--devices 10,50,500,5000] [--actions N] [--latency ms] [--fail rate] [--ack-ms ms] [--warm]\n" +
+                          "       node bench.js --devices N --record file.trace [--scenario sync|toggle]");
+            process.exit(2);
+        }
+    }
+    return args;
+}
+
+// Open the app on the watch and sync its lists; returns the measurements, and the phone to carry on with
+function sync(server, args, store) {
+    var phone = new Phone({server: server, store: store, ackMs: args.ackMs});
+    var started = process.hrtime();
+    phone.ready();
+    phone.run(SYNC_LIMIT_MS, function() {
+        return phone.firstSent(function(message) { return message.ready; }) !== null;
+    });
+    // The watch asks once the ready message reaches it
+    phone.run(args.ackMs);
+    var askedAt = phone.clock.now, requestsBefore = server.requests.length, sentBefore = phone.sent.length;
+    phone.receive(WATCH_REQUEST);
+    // A list is done once it's been sent in full, or the watch has been told it couldn't be fetched
+    var settled = function(key, couldNotConnect) {
+        return phone.sent.slice(sentBefore).some(function(sent) {
+            return sent.message[key] || (sent.message.could_not_connect & couldNotConnect);
+        });
+    };
+    var done = phone.run(SYNC_LIMIT_MS, function() {
+        return settled("device_count_complete", COULD_NOT_CONNECT_DEVICES) && settled("action_count_complete", COULD_NOT_CONNECT_ACTIONS);
+    });
+    var elapsed = process.hrtime(started);
+    var firstRow = phone.firstSent(function(message) { return message.device_records; });
+    var result = {
+        firstRowMs: firstRow ? firstRow.at - askedAt : null,
+        completeMs: done ? phone.clock.now - askedAt : null,
+        messages: phone.sent.length - sentBefore,
+        requests: server.requests.length - requestsBefore,
+        cpuMs: elapsed[0] * 1000 + elapsed[1] / 1e6
+    };
+    return {result: result, phone: phone};
+}
+
+// Open the devices list on the watch and count the requests its polling makes in the next minute
+function pollRequests(server, phone) {
+    var requestsBefore = server.requests.length;
+    phone.receive({"devices_visible": 1});
+    phone.run(POLL_WINDOW_MS);
+    return server.requests.length - requestsBefore;
+}
+
+function bench(args) {
+    console.log("devices  first row  complete  messages  requests  poll/min       cpu" + (args.fail ? "    (" + args.fail * 100 + "% failing)" : ""));
+    args.devices.forEach(function(deviceCount) {
+        var server = new MockIndigo({
+            devices: deviceCount,
+            actions: (args.actions !== null) ? args.actions : Math.min(deviceCount, 50),
+            latency: args.latency,
+            failureRate: args.fail
+        });
+        var runs = [["", sync(server, args)]];
+        runs[0][1].result.pollRequests = pollRequests(server, runs[0][1].phone);
+        if (args.warm) {
+            runs.push([" warm", sync(server, args, runs[0][1].phone.store)]);
+            runs[1][1].result.pollRequests = pollRequests(server, runs[1][1].phone);
+        }
+        runs.forEach(function(run) {
+            var result = run[1].result;
+            console.log(pad(deviceCount + run[0], 7) + pad(ms(result.firstRowMs), 11) + pad(ms(result.completeMs), 10) +
+                        pad(result.messages, 10) + pad(result.requests, 10) + pad(result.pollRequests, 10) +
+                        pad(result.cpuMs.toFixed(0) + " ms", 10));
+        });
+    });
+}
+
+function pad(value, width) {
+    value = String(value);
+    return (value.length < width) ? new Array(width - value.length + 1).join(" ") + value : value;
+}
+
+function ms(value) {
+    return (value === null) ? "-" : value + " ms";
+}
+
+// A value in the replay driver's trace format (see test/host/replay.c)
+function traceValue(value) {
+    if (Array.isArray(value)) {
+        return "x:" + value.map(function(byte) { return (byte < 16 ? "0" : "") + byte.toString(16); }).join("");
+    }
+    if (typeof value === "string") {
+        return "s:" + value.replace(/[^A-Za-z0-9._~-]/g, function(c) {
+            return Buffer.from(c).toString("hex").replace(/../g, "%$&");
+        });
+    }
+    if (typeof value === "boolean") {
+        value = value ? 1 : 0;
+    }
+    return ((value < 0) ? "i:" : "u:") + value;
+}
+
+function record(args) {
+    var deviceCount = args.devices[0], actionCount = (args.actions !== null) ? args.actions : Math.min(deviceCount, 50);
+    var server = new MockIndigo({devices: deviceCount, actions: actionCount, latency: args.latency, failureRate: args.fail});
+    var events = [], phone = null;
+    var event = function(line) {
+        events.push({at: phone ? phone.clock.now : 0, line: line});
+    };
+    var synced = sync(server, args);
+    phone = synced.phone;
+    synced.phone.sent.forEach(function(sent) {
+        var fields = Object.keys(sent.message).map(function(key) {
+            return APP_KEYS[key] + "=" + traceValue(sent.message[key]);
+        });
+        events.push({at: sent.at, line: "phone " + fields.join(" ")});
+    });
+    if (args.scenario === "toggle") {
+        var sentBefore = phone.sent.length;
+        event("select");
+        phone.run(100);
+        event("scroll 3");
+        phone.run(100);
+        event("select");
+        phone.receive({"device_toggle_on_off": 1, "device_number": 3, "device_on": server.devices[3].isOn ? 1 : 0});
+        phone.run(800);
+        event("back");
+        phone.sent.slice(sentBefore).forEach(function(sent) {
+            events.push({at: sent.at, line: "phone " + Object.keys(sent.message).map(function(key) {
+                return APP_KEYS[key] + "=" + traceValue(sent.message[key]);
+            }).join(" ")});
+        });
+    }
+    events.sort(function(a, b) { return a.at - b.at; });
+    var lines = ["# Recorded by test/js/bench.js from the phone script against a mock Indigo Server with " + deviceCount +
+                 " devices and " + actionCount + " actions",
+                 "# (" + args.scenario + ")"];
+    events.forEach(function(event) {
+        lines.push(event.at + " " + event.line);
+    });
+    fs.writeFileSync(args.record, lines.join("\n") + "\n");
+}
+
+var args = parseArgs(process.argv.slice(2));
+if (args.record) {
+    record(args);
+}
+else {
+    bench(args);
+}
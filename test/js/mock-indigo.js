@@ -0,0 +1,204 @@
+// A stand-in for the Indigo Server's REST API, as much of it as the phone script uses: the device and action
+// lists, each device's details (with ?toggle=1, ?isOn= and ?brightness= to control it), executing actions,
+// and HTTP digest authentication when given a username.
+//
+// Responses are decided when a request is sent and delivered latency ms later by the caller's clock (see
+// phone.js), so a run is repeatable: failures come from a seeded random number generator.
+
+var crypto = require("crypto");
+
+function md5(value) {
+    return crypto.createHash("md5").update(value).digest("hex");
+}
+
+// Small seeded PRNG (mulberry32), so a failure rate fails the same requests every run
+function random(seed) {
+    return function() {
+        seed = (seed + 0x6D2B79F5) | 0;
+        var t = Math.imul(seed ^ (seed >>> 15), 1 | seed);
+        t = (t + Math.imul(t ^ (t >>> 7), 61 | t)) ^ t;
+        return ((t ^ (t >>> 14)) >>> 0) / 4294967296;
+    };
+}
+
+// Parse the parameters of an Authorization: Digest header
+function parseDigest(header) {
+    var params = {}, param = /(\w+)=(?:"([^"]*)"|([^\s,]*))/g, match;
+    if (!header || (header.indexOf("Digest ") !== 0)) {
+        return null;
+    }
+    while ((match = param.exec(header)) !== null) {
+        params[match[1]] = (match[2] !== undefined) ? match[2] : match[3];
+    }
+    return params;
+}
+
+// options (all optional):
+//   devices          Number of devices (50); every onOffEvery'th one (5) can't be switched, as a thermostat can't
+//   actions          Number of action groups (50)
+//   latency          ms from request to response (20), or function(path) returning it
+//   failureRate      Fraction of requests answered with a 500 (0)
+//   seed             For the failure rate (1)
+//   username         Turns on digest authentication, with password and realm ("Indigo")
+//   nonceUses        Requests a nonce answers before the server retires it and says stale=true (Infinity)
+//   qop              Whether challenges offer qop="auth" (true)
+function MockIndigo(options) {
+    options = options || {};
+    var deviceCount = (options.devices !== undefined) ? options.devices : 50;
+    var actionCount = (options.actions !== undefined) ? options.actions : 50;
+    var onOffEvery = options.onOffEvery || 5;
+    var i;
+
+    this.latency = (options.latency !== undefined) ? options.latency : 20;
+    this.failureRate = options.failureRate || 0;
+    this.random = random(options.seed || 1);
+    this.username = options.username || "";
+    this.password = options.password || "";
+    this.realm = options.realm || "Indigo";
+    this.nonceUses = options.nonceUses || Infinity;
+    this.qop = (options.qop !== false);
+
+    this.devices = [];
+    for (i = 0; i < deviceCount; i += 1) {
+        this.devices.push({
+            name: "Device " + i,
+            restURL: "/devices/device" + i + ".json",
+            isOn: (i % 2) === 0,
+            typeSupportsOnOff: (i % onOffEvery) !== (onOffEvery - 1),
+            brightness: 0
+        });
+    }
+    this.actions = [];
+    for (i = 0; i < actionCount; i += 1) {
+        this.actions.push({name: "Action " + i, restURL: "/actions/action" + i + ".json"});
+    }
+    this.byURL = {};
+    this.devices.concat(this.actions).forEach(function(record) {
+        this.byURL[record.restURL] = record;
+    }, this);
+
+    // Every request, in the order sent: {path, status, authorization}
+    this.requests = [];
+    // Digest state: the requests each nonce we've issued has answered, and the highest nc seen with it
+    this.nonceSerial = 0;
+    this.nonceUsed = {};
+    this.highestNc = {};
+}
+
+// Number of requests for paths starting with the given prefix, e.g. "/devices/"; every request without one
+MockIndigo.prototype.requestCount = function(prefix) {
+    return this.requests.filter(function(request) {
+        return !prefix || (request.path.indexOf(prefix) === 0);
+    }).length;
+};
+
+MockIndigo.prototype.newNonce = function() {
+    this.nonceSerial += 1;
+    var nonce = md5("nonce" + this.nonceSerial);
+    this.nonceUsed[nonce] = 0;
+    this.highestNc[nonce] = 0;
+    return nonce;
+};
+
+MockIndigo.prototype.challenge = function(stale) {
+    var header = 'Digest realm="' + this.realm + '", nonce="' + this.newNonce() + '", opaque="' + md5(this.realm) + '"';
+    if (this.qop) {
+        header += ', qop="auth"';
+    }
+    if (stale) {
+        header += ", stale=true";
+    }
+    return {status: 401, body: "", headers: {"www-authenticate": header}};
+};
+
+// Check a request's digest answer; returns null if it's good, otherwise the 401 to send
+MockIndigo.prototype.authenticate = function(method, uri, header) {
+    var params = parseDigest(header);
+    if (!params) {
+        return this.challenge(false);
+    }
+    var ha1 = md5(this.username + ":" + this.realm + ":" + this.password);
+    var ha2 = md5(method + ":" + uri);
+    var expected = params.qop ?
+        md5([ha1, params.nonce, params.nc, params.cnonce, params.qop, ha2].join(":")) :
+        md5([ha1, params.nonce, ha2].join(":"));
+    if ((params.username !== this.username) || (params.uri !== uri) || (params.response !== expected)) {
+        return this.challenge(false);
+    }
+    // A correct answer to a nonce we didn't issue (e.g. before a restart), or have used up, is stale rather than wrong
+    if (!this.nonceUsed.hasOwnProperty(params.nonce) || (this.nonceUsed[params.nonce] >= this.nonceUses)) {
+        return this.challenge(true);
+    }
+    // A replayed nc is an attack, or a client bug
+    if (params.qop) {
+        var nc = parseInt(params.nc, 16);
+        if (!(nc > this.highestNc[params.nonce])) {
+            return this.challenge(false);
+        }
+        this.highestNc[params.nonce] = nc;
+    }
+    this.nonceUsed[params.nonce] += 1;
+    return null;
+};
+
+// Answer a request: {status, body, headers}
+MockIndigo.prototype.handle = function(method, url, headers) {
+    var path = url.replace(/^[a-z]+:\/\/[^\/]*/, ""), query = "";
+    var queryStart = path.indexOf("?");
+    if (queryStart >= 0) {
+        query = path.substring(queryStart + 1);
+        path = path.substring(0, queryStart);
+    }
+    var response = this.respond(method, path, query, url.replace(/^[a-z]+:\/\/[^\/]*/, ""), headers);
+    this.requests.push({path: path, status: response.status, authorization: headers.authorization || null});
+    return response;
+};
+
+MockIndigo.prototype.respond = function(method, path, query, uri, headers) {
+    if (this.username !== "") {
+        var rejection = this.authenticate(method, uri, headers.authorization);
+        if (rejection) {
+            return rejection;
+        }
+    }
+    if ((this.failureRate > 0) && (this.random() < this.failureRate)) {
+        return {status: 500, body: "", headers: {}};
+    }
+    var list = function(records) {
+        return JSON.stringify(records.map(function(record) {
+            return {name: record.name, restURL: record.restURL};
+        }));
+    };
+    if (path === "/devices.json") {
+        return {status: 200, body: list(this.devices), headers: {}};
+    }
+    if (path === "/actions.json") {
+        return {status: 200, body: list(this.actions), headers: {}};
+    }
+    var record = this.byURL[path];
+    if (!record) {
+        return {status: 404, body: "", headers: {}};
+    }
+    if (path.indexOf("/actions/") === 0) {
+        return {status: 200, body: "{}", headers: {}};
+    }
+    var match;
+    if (/(^|&)toggle=1/.test(query)) {
+        record.isOn = !record.isOn;
+    }
+    if ((match = /(^|&)isOn=(\d)/.exec(query))) {
+        record.isOn = (match[2] === "1");
+    }
+    if ((match = /(^|&)brightness=(\d+)/.exec(query))) {
+        record.brightness = parseInt(match[2], 10);
+        record.isOn = (record.brightness > 0);
+    }
+    return {status: 200, body: JSON.stringify(record), headers: {}};
+};
+
+// ms until the response to the given path arrives
+MockIndigo.prototype.latencyFor = function(path) {
+    return (typeof this.latency === "function") ? this.latency(path) : this.latency;
+};
+
+module.exports = MockIndigo;
@@ -0,0 +1,225 @@
+// Runs the phone script under Node against a MockIndigo, with stand-ins for what PebbleKit JS gives it:
+// Pebble (app messages to and from the watch), localStorage and XMLHttpRequest. Time is virtual: timers,
+// Date.now() and the server's latency all run on one clock that only moves when run() moves it, so a run
+// takes as long as the script's own work and measures the same every time.
+
+var fs = require("fs");
+var path = require("path");
+var vm = require("vm");
+
+var SCRIPT = path.join(__dirname, "../../src/js-pre-browserify/pebble-js-app-pre-browserify.js");
+
+// Timers on the virtual clock, fired in due order, then in the order they were set
+function Clock() {
+    this.now = 0;
+    this.timers = [];
+    this.nextId = 1;
+}
+
+Clock.prototype.setTimer = function(callback, ms, repeat) {
+    var timer = {id: this.nextId++, due: this.now + Math.max(ms || 0, 0), interval: repeat ? Math.max(ms || 0, 1) : 0, callback: callback};
+    this.timers.push(timer);
+    return timer.id;
+};
+
+Clock.prototype.clearTimer = function(id) {
+    this.timers = this.timers.filter(function(timer) {
+        return timer.id !== id;
+    });
+};
+
+// Fire the next timer due by the given time; returns false if there isn't one
+Clock.prototype.step = function(until) {
+    var next = null;
+    this.timers.forEach(function(timer) {
+        if ((timer.due <= until) && (!next || (timer.due < next.due) || ((timer.due === next.due) && (timer.id < next.id)))) {
+            next = timer;
+        }
+    });
+    if (!next) {
+        return false;
+    }
+    this.now = Math.max(this.now, next.due);
+    if (next.interval) {
+        next.due = this.now + next.interval;
+    }
+    else {
+        this.clearTimer(next.id);
+    }
+    next.callback();
+    return true;
+};
+
+// options (all optional):
+//   server       MockIndigo to talk to
+//   store        Initial localStorage, e.g. a previous phone's store to start from its saved state
+//   ackMs        ms from sending an app message to the watch's ack (20)
+//   nack         function(message) returning true for messages the watch should nack
+//   verbose      Show the script's console.log
+function Phone(options) {
+    options = options || {};
+    var phone = this;
+    var clock = this.clock = new Clock();
+    var listeners = {};
+
+    this.server = options.server;
+    this.ackMs = (options.ackMs !== undefined) ? options.ackMs : 20;
+    this.nack = options.nack || null;
+    // Every app message sent to the watch: {at, message}, and every one from it: {at, payload}
+    this.sent = [];
+    this.received = [];
+    this.store = {};
+    Object.keys(options.store || {}).forEach(function(key) {
+        phone.store[key] = options.store[key];
+    });
+    if (this.store.serverAddress === undefined) {
+        this.store.serverAddress = "indigo.local";
+    }
+
+    var localStorage = {
+        getItem: function(key) {
+            return phone.store.hasOwnProperty(key) ? phone.store[key] : null;
+        },
+        setItem: function(key, value) {
+            phone.store[key] = String(value);
+        },
+        removeItem: function(key) {
+            delete phone.store[key];
+        }
+    };
+
+    // Requests go to the server as they're sent, and its response comes back by the clock
+    function XMLHttpRequest() {
+        this.readyState = 0;
+        this.status = 0;
+        this.responseText = "";
+        this.requestHeaders = {};
+        this.responseHeaders = {};
+        this.aborted = false;
+    }
+    XMLHttpRequest.prototype.open = function(method, url) {
+        this.method = method;
+        this.url = url;
+    };
+    XMLHttpRequest.prototype.setRequestHeader = function(name, value) {
+        this.requestHeaders[name.toLowerCase()] = value;
+    };
+    XMLHttpRequest.prototype.getResponseHeader = function(name) {
+        return this.responseHeaders[name.toLowerCase()] || null;
+    };
+    XMLHttpRequest.prototype.abort = function() {
+        this.aborted = true;
+    };
+    XMLHttpRequest.prototype.send = function() {
+        var req = this;
+        var response = phone.server.handle(req.method, req.url, req.requestHeaders);
+        clock.setTimer(function() {
+            if (req.aborted) {
+                return;
+            }
+            req.readyState = 4;
+            req.status = response.status;
+            req.responseText = response.body;
+            req.responseHeaders = response.headers;
+            if (req.onload) {
+                req.onload({});
+            }
+        }, phone.server.latencyFor(req.url.replace(/^[a-z]+:\/\/[^\/?]*/, "")));
+    };
+
+    var Pebble = {
+        addEventListener: function(type, listener) {
+            listeners[type] = listener;
+        },
+        openURL: function() {},
+        sendAppMessage: function(message, onAck, onNack) {
+            var copy = JSON.parse(JSON.stringify(message));
+            phone.sent.push({at: clock.now, message: copy});
+            var nacked = phone.nack && phone.nack(copy);
+            clock.setTimer(function() {
+                if (nacked) {
+                    if (onNack) {
+                        onNack({data: {transactionId: 0}, error: {message: "NACK"}});
+                    }
+                }
+                else if (onAck) {
+                    onAck({data: {transactionId: 0}});
+                }
+            }, phone.ackMs);
+            return 0;
+        }
+    };
+
+    var VirtualDate = function() {
+        var args = Array.prototype.slice.call(arguments);
+        return args.length ? new (Function.prototype.bind.apply(Date, [null].concat(args)))() : new Date(clock.now);
+    };
+    VirtualDate.now = function() {
+        return clock.now;
+    };
+
+    var context = {
+        console: options.verbose ? console : {log: function() {}, warn: function() {}, error: function() {}},
+        setTimeout: function(callback, ms) {
+            return clock.setTimer(callback, ms, false);
+        },
+        clearTimeout: function(id) {
+            clock.clearTimer(id);
+        },
+        setInterval: function(callback, ms) {
+            return clock.setTimer(callback, ms, true);
+        },
+        clearInterval: function(id) {
+            clock.clearTimer(id);
+        },
+        Date: VirtualDate,
+        require: require,
+        localStorage: localStorage,
+        XMLHttpRequest: XMLHttpRequest,
+        Pebble: Pebble
+    };
+    context.window = context;
+    vm.createContext(context);
+    vm.runInContext(fs.readFileSync(SCRIPT, "utf8"), context, {filename: SCRIPT});
+    this.listeners = listeners;
+}
+
+// The app on the watch started, so PebbleKit JS says the script is ready
+Phone.prototype.ready = function() {
+    this.listeners.ready({ready: true, type: "ready"});
+};
+
+// The user saved the settings on the configuration page, e.g. {serverAddress, serverPort, username, password}
+Phone.prototype.closeConfiguration = function(options) {
+    this.listeners.webviewclosed({response: encodeURIComponent(JSON.stringify(options))});
+};
+
+// A message from the watch
+Phone.prototype.receive = function(payload) {
+    this.received.push({at: this.clock.now, payload: payload});
+    this.listeners.appmessage({payload: payload});
+};
+
+// Run the clock forward ms, or until done() returns true; returns whether done() did
+Phone.prototype.run = function(ms, done) {
+    var until = this.clock.now + ms;
+    while (!(done && done())) {
+        if (!this.clock.step(until)) {
+            this.clock.now = until;
+            return done ? done() : true;
+        }
+    }
+    return true;
+};
+
+// The first message sent to the watch that the given function accepts, or null
+Phone.prototype.firstSent = function(accept) {
+    for (var i = 0; i < this.sent.length; i += 1) {
+        if (accept(this.sent[i].message)) {
+            return this.sent[i];
+        }
+    }
+    return null;
+};
+
+module.exports = Phone;
@@ -0,0 +1,73 @@
+// Saving the configuration page syncs the watch's lists from the server once: the phone tells the watch its
+// lists are loading again, and the watch's request for them (as its top menu loads afresh) is what starts the
+// sync, rather than racing one the phone started itself.
+//
+//     node test-configuration.js
+
+var assert = require("assert");
+var MockIndigo = require("./mock-indigo");
+var Phone = require("./phone");
+
+var WATCH_REQUEST = {"get_devices_and_actions": 1, "inbox_size": 2026, "visible_list": 1, "visible_row": 0, "visible_row_count": 4};
+var ACK_MS = 20;
+
+// Stand in for the watch: open the app and sync, then have the user save the configuration page, with the
+// watch asking for its lists again as soon as it hears they're loading
+function configure(server, options) {
+    var phone = new Phone({server: server, ackMs: ACK_MS});
+    phone.ready();
+    phone.run(100);
+    phone.receive(WATCH_REQUEST);
+    phone.run(10000);
+    var requestsBefore = server.requests.length, sentBefore = phone.sent.length;
+    phone.closeConfiguration(options);
+    var loading = phone.sent.slice(sentBefore).filter(function(sent) { return sent.message.loading; })[0];
+    assert.ok(loading, "the watch wasn't told its lists are loading");
+    phone.run(ACK_MS);
+    phone.receive(WATCH_REQUEST);
+    phone.run(10000);
+    return {phone: phone, requests: server.requests.slice(requestsBefore), sentBefore: sentBefore};
+}
+
+function listRequests(requests, path) {
+    return requests.filter(function(request) { return request.path === path; }).length;
+}
+
+var tests = {
+    "requests each list once": function() {
+        var run = configure(new MockIndigo({devices: 20, actions: 5}), {serverAddress: "indigo.local", serverPort: "8176"});
+        assert.strictEqual(listRequests(run.requests, "/devices.json"), 1);
+        assert.strictEqual(listRequests(run.requests, "/actions.json"), 1);
+    },
+
+    "sends the watch the lists in full": function() {
+        var run = configure(new MockIndigo({devices: 20, actions: 5}), {serverAddress: "indigo.local", serverPort: "8176"});
+        var complete = run.phone.sent.slice(run.sentBefore).filter(function(sent) {
+            return sent.message.device_count_complete;
+        });
+        assert.strictEqual(complete.length, 1);
+        assert.strictEqual(complete[0].message.device_count, 16);
+        assert.ok(run.phone.sent.slice(run.sentBefore).some(function(sent) { return sent.message.action_count_complete; }));
+    },
+
+    "syncs with the credentials just entered": function() {
+        // The server wants credentials the phone had yet to be given, so the first sync couldn't connect
+        var run = configure(new MockIndigo({devices: 20, actions: 5, username: "indigo", password: "new"}),
+                            {serverAddress: "indigo.local", serverPort: "8176", username: "indigo", password: "new"});
+        assert.ok(run.requests.some(function(request) { return request.authorization && (request.status === 200); }));
+        assert.strictEqual(listRequests(run.requests.filter(function(request) { return request.status === 200; }), "/devices.json"), 1);
+    }
+};
+
+var failed = 0;
+Object.keys(tests).forEach(function(name) {
+    try {
+        tests[name]();
+        console.log("ok - " + name);
+    }
+    catch (e) {
+        failed += 1;
+        console.log("not ok - " + name + "\n    " + e.message);
+    }
+});
+process.exit(failed ? 1 : 0);
@@ -0,0 +1,110 @@
+// The phone script's HTTP digest authentication against the mock Indigo Server: it answers the first
+// challenge and then every request up front, counting up nc as it reuses the nonce; it takes one more try
+// when the server retires the nonce (stale=true); and wrong credentials come back as the 401 they are rather
+// than being retried for ever.
+//
+//     node test-digest.js
+
+var assert = require("assert");
+var MockIndigo = require("./mock-indigo");
+var Phone = require("./phone");
+
+var CREDENTIALS = {username: "indigo", password: "s3cret: \"quoted\""};
+
+// Sync the watch's lists from a server wanting the given credentials, with the phone using its own
+function sync(serverOptions, store) {
+    var server = new MockIndigo(Object.assign({devices: 20, actions: 5}, CREDENTIALS, serverOptions));
+    var phone = new Phone({server: server, store: Object.assign({}, CREDENTIALS, store)});
+    phone.ready();
+    phone.run(100);
+    phone.receive({"get_devices_and_actions": 1, "inbox_size": 2026, "visible_list": 1, "visible_row": 0, "visible_row_count": 4});
+    phone.run(10000);
+    return {server: server, phone: phone};
+}
+
+function challenges(server) {
+    return server.requests.filter(function(request) { return request.status === 401; });
+}
+
+function param(authorization, name) {
+    var match = new RegExp(name + '="?([^",]*)').exec(authorization);
+    return match ? match[1] : null;
+}
+
+function devicesSent(phone) {
+    var complete = phone.firstSent(function(message) { return message.device_count_complete; });
+    return complete ? complete.message.device_count : null;
+}
+
+var tests = {
+    "answers the first challenge, then every request up front": function() {
+        var run = sync({});
+        // Only the list requests, sent together before there was a challenge to answer, are challenged
+        var unanswered = run.server.requests.filter(function(request) { return request.authorization === null; });
+        assert.deepStrictEqual(unanswered.map(function(request) { return request.path; }).sort(), ["/actions.json", "/devices.json"]);
+        assert.deepStrictEqual(challenges(run.server), unanswered);
+        run.server.requests.forEach(function(request) {
+            assert.ok((request.status === 200) || (request.authorization === null), request.path);
+        });
+        assert.strictEqual(devicesSent(run.phone), 16);
+    },
+
+    "reuses the nonce with nc counting up": function() {
+        var run = sync({});
+        var ncs = {};
+        run.server.requests.forEach(function(request) {
+            if (request.authorization) {
+                var nonce = param(request.authorization, "nonce");
+                ncs[nonce] = (ncs[nonce] || []).concat([parseInt(param(request.authorization, "nc"), 16)]);
+            }
+        });
+        // A nonce for each challenge, the last one taking every request after
+        assert.strictEqual(Object.keys(ncs).length, 2);
+        Object.keys(ncs).forEach(function(nonce) {
+            ncs[nonce].forEach(function(nc, i) {
+                assert.strictEqual(nc, i + 1);
+            });
+        });
+        assert.ok(Math.max.apply(null, Object.keys(ncs).map(function(nonce) { return ncs[nonce].length; })) > 16);
+    },
+
+    "takes a fresh nonce when the server says stale": function() {
+        var run = sync({nonceUses: 5});
+        // Past the two list requests' challenges, every 401 is a retired nonce
+        var stale = challenges(run.server).length - 2;
+        assert.ok(stale >= 3, "expected the nonce to go stale, got " + stale + " times");
+        // Each stale answer is retried with the new nonce, so nothing fails and every device arrives
+        assert.strictEqual(run.server.requests.filter(function(request) { return request.status === 200; }).length,
+                           run.server.requests.length - challenges(run.server).length);
+        assert.strictEqual(devicesSent(run.phone), 16);
+        assert.strictEqual(run.phone.firstSent(function(message) { return message.could_not_connect; }), null);
+    },
+
+    "passes wrong credentials through as a 401": function() {
+        var run = sync({}, {password: "wrong"});
+        // The device list was asked for once without an answer and once with, then given up on
+        var listRequests = run.server.requests.filter(function(request) { return request.path === "/devices.json"; });
+        assert.deepStrictEqual(listRequests.map(function(request) { return request.status; }), [401, 401]);
+        assert.strictEqual(run.server.requestCount("/devices/"), 0);
+        assert.ok(run.phone.firstSent(function(message) { return message.could_not_connect; }));
+    },
+
+    "sends no credentials to a server without a username": function() {
+        var run = sync({username: "", password: ""}, {username: "", password: ""});
+        assert.strictEqual(challenges(run.server).length, 0);
+        assert.ok(run.server.requests.every(function(request) { return request.authorization === null; }));
+    }
+};
+
+var failed = 0;
+Object.keys(tests).forEach(function(name) {
+    try {
+        tests[name]();
+        console.log("ok - " + name);
+    }
+    catch (e) {
+        failed += 1;
+        console.log("not ok - " + name + "\n    " + e.message);
+    }
+});
+process.exit(failed ? 1 : 0);
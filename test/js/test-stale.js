@@ -0,0 +1,135 @@
+// Device states the phone only knows from an earlier run reach the watch marked stale: a launch that takes
+// every device from the capability cache sends them so with just the two list requests, and the watch's
+// rows are confirmed by the poll when the devices list opens, the rows on screen first.
+//
+//     node test-stale.js
+
+var assert = require("assert");
+var MockIndigo = require("./mock-indigo");
+var Phone = require("./phone");
+
+var RECORD_ON_BIT = 0x01;
+var RECORD_STALE_BIT = 0x80;
+var WATCH_REQUEST = {"get_devices_and_actions": 1, "inbox_size": 2026, "visible_list": 1, "visible_row": 0, "visible_row_count": 4};
+
+// The device records packed into a message: [{number, name, on, stale}]
+function unpackRecords(bytes) {
+    var records = [], offset = 0, number = -1;
+    while (offset < bytes.length) {
+        var zigzag = 0, shift = 0, byte;
+        do {
+            byte = bytes[offset++];
+            zigzag += (byte & 0x7F) * Math.pow(2, shift);
+            shift += 7;
+        } while (byte & 0x80);
+        number += 1 + ((zigzag % 2) ? -(zigzag + 1) / 2 : zigzag / 2);
+        var flags = bytes[offset++], length = (flags & 0x7F) >> 1;
+        records.push({
+            number: number,
+            name: Buffer.from(bytes.slice(offset, offset + length)).toString(),
+            on: Boolean(flags & RECORD_ON_BIT),
+            stale: Boolean(flags & RECORD_STALE_BIT)
+        });
+        offset += length;
+    }
+    return records;
+}
+
+// Every device record sent since the given message, in the order sent, with when it was sent
+function deviceRecords(phone, since) {
+    var records = [];
+    phone.sent.slice(since || 0).forEach(function(sent) {
+        if (sent.message.device_records) {
+            unpackRecords(sent.message.device_records).forEach(function(record) {
+                record.at = sent.at;
+                records.push(record);
+            });
+        }
+    });
+    return records;
+}
+
+// Open the app and sync; returns the phone, and where in its messages the sync started
+function launch(server, store) {
+    var phone = new Phone({server: server, store: store});
+    phone.ready();
+    phone.run(100);
+    phone.receive(WATCH_REQUEST);
+    phone.run(10000);
+    return phone;
+}
+
+var tests = {
+    "sends the states a cold sync fetched as confirmed": function() {
+        var server = new MockIndigo({devices: 20, actions: 2});
+        var records = deviceRecords(launch(server));
+        assert.strictEqual(records.length, 16);
+        assert.ok(records.every(function(record) { return !record.stale; }));
+    },
+
+    "sends cached states as stale with only the list requests": function() {
+        var server = new MockIndigo({devices: 20, actions: 2});
+        var store = launch(server).store;
+        var requestsBefore = server.requests.length;
+        var phone = launch(server, store);
+        assert.deepStrictEqual(server.requests.slice(requestsBefore).map(function(request) { return request.path; }).sort(),
+                               ["/actions.json", "/devices.json"]);
+        var records = deviceRecords(phone);
+        assert.strictEqual(records.length, 16);
+        assert.ok(records.every(function(record) { return record.stale; }));
+    },
+
+    "confirms every row when the devices list opens, the visible ones first": function() {
+        var server = new MockIndigo({devices: 50, actions: 2});
+        var store = launch(server).store;
+        // Behind our back, a row on screen and one off it change
+        server.devices[1].isOn = !server.devices[1].isOn;
+        server.devices[30].isOn = !server.devices[30].isOn;
+        var phone = launch(server, store);
+        var sentBefore = phone.sent.length, requestsBefore = server.requests.length;
+        phone.receive({"devices_visible": 1});
+        phone.run(1000);
+
+        // One request for each device on the list, and nothing left stale
+        assert.strictEqual(server.requests.length - requestsBefore, 40);
+        var records = deviceRecords(phone, sentBefore), latest = {};
+        records.forEach(function(record) {
+            latest[record.number] = record;
+        });
+        assert.strictEqual(Object.keys(latest).length, 40);
+        Object.keys(latest).forEach(function(number) {
+            var record = latest[number];
+            assert.ok(!record.stale, "device " + number + " is still stale");
+            assert.strictEqual(record.on, server.devices.filter(function(device) {
+                return device.name === record.name;
+            })[0].isOn, record.name);
+        });
+        // The rows on screen (0 to 3) were confirmed before the rest
+        var lastVisible = Math.max.apply(null, records.filter(function(record) { return record.number < 4; }).map(function(record) { return record.at; }));
+        var firstOther = Math.min.apply(null, records.filter(function(record) { return record.number >= 4; }).map(function(record) { return record.at; }));
+        assert.ok(lastVisible < firstOther, "visible rows confirmed at " + lastVisible + " ms, others from " + firstOther + " ms");
+    },
+
+    "sends nothing more once the states are confirmed": function() {
+        var server = new MockIndigo({devices: 20, actions: 2});
+        var phone = launch(server, launch(server).store);
+        phone.receive({"devices_visible": 1});
+        phone.run(1000);
+        var sentBefore = phone.sent.length;
+        phone.run(60000);
+        assert.strictEqual(deviceRecords(phone, sentBefore).length, 0);
+    }
+};
+
+var failed = 0;
+Object.keys(tests).forEach(function(name) {
+    try {
+        tests[name]();
+        console.log("ok - " + name);
+    }
+    catch (e) {
+        failed += 1;
+        console.log("not ok - " + name + "\n    " + e.message);
+    }
+});
+process.exit(failed ? 1 : 0);